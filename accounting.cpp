@@ -0,0 +1,437 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+#include <daemon/accounting.hpp>
+
+namespace daemonize {
+
+typedef std::chrono::steady_clock clock_type;
+
+struct live_child {
+	std::string               path;
+	bool                      detached;
+	uint64_t                  started_us;
+	clock_type::time_point    started;
+	unsigned long long        starttime; ///< clock ticks since boot, guards against pid reuse
+	std::deque<usage_sample>  timeline;
+};
+
+struct proc_stat {
+	char               state;
+	unsigned long long starttime;
+	uint64_t           cpu_us;
+	uint64_t           rss;
+};
+
+static std::mutex                              g_mutex;
+static std::atomic<size_t>                     g_max_records(0);
+static size_t                                  g_max_samples = 64;
+static std::unordered_map<pid_t, live_child>   g_live;
+static std::deque<exit_record>                 g_records;
+static size_t                                  g_max_live = 65536;
+static uint64_t                                g_untracked = 0;
+
+static uint64_t since_us(clock_type::time_point since) {
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - since).count());
+}
+
+static uint64_t tv_us(const timeval &tv) {
+	return static_cast<uint64_t>(tv.tv_sec) * 1000000 + static_cast<uint64_t>(tv.tv_usec);
+}
+
+static int read_stat(pid_t pid, proc_stat *st) {
+	static const long ticks = sysconf(_SC_CLK_TCK);
+	static const long page  = sysconf(_SC_PAGESIZE);
+
+	char path[32];
+	char buf[1024];
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	ssize_t rd = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if (rd <= 0) {
+		return -1;
+	}
+
+	buf[rd] = '\0';
+
+	/* comm may contain anything, fields start after the last ')' */
+	const char *p = strrchr(buf, ')');
+	if (p == nullptr) {
+		return -1;
+	}
+
+	unsigned long utime;
+	unsigned long stime;
+	long          rss;
+
+	if (sscanf(p + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %llu %*u %ld",
+	           &st->state, &utime, &stime, &st->starttime, &rss) != 5) {
+		return -1;
+	}
+
+	st->cpu_us = static_cast<uint64_t>(utime + stime) * 1000000 / static_cast<uint64_t>(ticks);
+	st->rss    = rss > 0 ? static_cast<uint64_t>(rss) * static_cast<uint64_t>(page) : 0;
+
+	return 0;
+}
+
+/**
+ * \brief   Must be called with g_mutex held
+ */
+static void push_record(exit_record &&rec) {
+	size_t max_records = g_max_records.load();
+
+	if (max_records != 0) {
+		while (g_records.size() >= max_records) {
+			g_records.pop_front();
+		}
+
+		g_records.push_back(std::move(rec));
+	}
+}
+
+/**
+ * \brief   Move child from live set into records. Must be called with g_mutex held
+ *          Children not tracked (beyond the cap or not spawned by the library) are not recorded
+ */
+static void finalize(pid_t pid, live_child *child, int status, const rusage *ru, exit_record *out) {
+	exit_record rec;
+
+	rec.pid    = pid;
+	rec.status = status;
+	rec.reaped = ru != nullptr;
+
+	if (child) {
+		rec.path        = child->path;
+		rec.started_us  = child->started_us;
+		rec.lifetime_us = since_us(child->started);
+		rec.timeline.assign(child->timeline.begin(), child->timeline.end());
+	}
+
+	if (ru) {
+		rec.user_us = tv_us(ru->ru_utime);
+		rec.sys_us  = tv_us(ru->ru_stime);
+		rec.max_rss = static_cast<uint64_t>(ru->ru_maxrss) * 1024;
+		rec.minflt  = static_cast<uint64_t>(ru->ru_minflt);
+		rec.majflt  = static_cast<uint64_t>(ru->ru_majflt);
+		rec.nvcsw   = static_cast<uint64_t>(ru->ru_nvcsw);
+		rec.nivcsw  = static_cast<uint64_t>(ru->ru_nivcsw);
+		rec.inblock = static_cast<uint64_t>(ru->ru_inblock);
+		rec.oublock = static_cast<uint64_t>(ru->ru_oublock);
+	} else if (!rec.timeline.empty()) {
+		/* best we know about process we can't wait for */
+		rec.user_us = rec.timeline.back().cpu_us;
+
+		for (const auto &s : rec.timeline) {
+			rec.max_rss = std::max(rec.max_rss, s.rss);
+		}
+	}
+
+	if (out) {
+		*out = rec;
+	}
+
+	if (child != nullptr) {
+		push_record(std::move(rec));
+	}
+}
+
+void accounting::enable(size_t max_records, size_t max_samples, size_t max_live) {
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	g_max_records = max_records;
+	g_max_samples = max_samples;
+	g_max_live    = max_live;
+
+	if (max_records == 0) {
+		g_live.clear();
+	}
+
+	while (g_records.size() > max_records) {
+		g_records.pop_front();
+	}
+}
+
+void accounting::track(pid_t pid, const char *path, bool detached) {
+	if (g_max_records.load() == 0 || pid <= 0) {
+		return;
+	}
+
+	live_child child;
+
+	child.path       = path ? path : "";
+	child.detached   = detached;
+	child.started    = clock_type::now();
+	child.started_us = static_cast<uint64_t>(
+		std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+
+	proc_stat st = {};
+	child.starttime = read_stat(pid, &st) == 0 ? st.starttime : 0;
+
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	if (g_live.size() >= g_max_live) {
+		++g_untracked;
+		return;
+	}
+
+	g_live[pid] = std::move(child);
+}
+
+void accounting::untrack(pid_t pid) {
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	g_live.erase(pid);
+}
+
+pid_t accounting::wait(pid_t pid, int *status, int options, exit_record *rec) {
+	int     st = 0;
+	rusage  ru = {};
+	pid_t   ret;
+
+	while ((ret = wait4(pid, &st, options, &ru)) < 0 && errno == EINTR) {
+	}
+
+	if (status) {
+		*status = st;
+	}
+
+	if (ret > 0 && (WIFEXITED(st) || WIFSIGNALED(st))) {
+		std::lock_guard<std::mutex> lock(g_mutex);
+
+		auto it = g_live.find(ret);
+
+		if (it != g_live.end()) {
+			finalize(ret, &it->second, st, &ru, rec);
+			g_live.erase(it);
+		} else {
+			finalize(ret, nullptr, st, &ru, rec);
+		}
+	}
+
+	return ret;
+}
+
+size_t accounting::sample() {
+	std::vector<std::pair<pid_t, unsigned long long>> pids;
+
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+
+		pids.reserve(g_live.size());
+
+		for (const auto &it : g_live) {
+			pids.emplace_back(it.first, it.second.starttime);
+		}
+	}
+
+	/* /proc is read without lock, so spawning threads are not held */
+	std::vector<std::pair<pid_t, proc_stat>> stats;
+	std::vector<pid_t> gone;
+
+	stats.reserve(pids.size());
+
+	for (const auto &p : pids) {
+		proc_stat st = {};
+
+		if (read_stat(p.first, &st) != 0 || (p.second != 0 && st.starttime != p.second)) {
+			gone.push_back(p.first);
+		} else if (st.state != 'Z') {
+			stats.emplace_back(p.first, st);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	for (const auto &s : stats) {
+		auto it = g_live.find(s.first);
+		if (it == g_live.end()) {
+			continue;
+		}
+
+		live_child &child = it->second;
+
+		if (g_max_samples == 0) {
+			continue;
+		}
+
+		while (child.timeline.size() >= g_max_samples) {
+			child.timeline.pop_front();
+		}
+
+		usage_sample sample;
+		sample.at_us  = since_us(child.started);
+		sample.rss    = s.second.rss;
+		sample.cpu_us = s.second.cpu_us;
+
+		child.timeline.push_back(sample);
+	}
+
+	/* detached children, or children reaped bypassing wait() */
+	for (pid_t pid : gone) {
+		auto it = g_live.find(pid);
+		if (it == g_live.end()) {
+			continue;
+		}
+
+		finalize(pid, &it->second, 0, nullptr, nullptr);
+		g_live.erase(it);
+	}
+
+	return g_live.size();
+}
+
+std::vector<exit_record> accounting::records() {
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	return std::vector<exit_record>(g_records.begin(), g_records.end());
+}
+
+static uint64_t order_value(accounting::order key, const exit_record &rec) {
+	switch (key) {
+	case accounting::order::cpu:
+		return rec.user_us + rec.sys_us;
+	case accounting::order::rss:
+		return rec.max_rss;
+	case accounting::order::lifetime:
+		return rec.lifetime_us;
+	case accounting::order::io:
+		return rec.inblock + rec.oublock;
+	}
+
+	return 0;
+}
+
+std::vector<exit_record> accounting::top(order key, size_t n) {
+	std::vector<exit_record> recs(records());
+
+	n = std::min(n, recs.size());
+
+	std::partial_sort(recs.begin(), recs.begin() + static_cast<std::ptrdiff_t>(n), recs.end(),
+		[key](const exit_record &a, const exit_record &b) {
+			return order_value(key, a) > order_value(key, b);
+		});
+
+	recs.resize(n);
+
+	return recs;
+}
+
+Json::Value accounting::dump(size_t top_n) {
+	std::vector<exit_record> all(records());
+	std::vector<exit_record> recs(top_n ? top(order::cpu, top_n) : all);
+
+	Json::Value result;
+	Json::Value list(Json::arrayValue);
+	Json::Value by_path(Json::objectValue);
+
+	size_t   live;
+	uint64_t untracked;
+
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		live      = g_live.size();
+		untracked = g_untracked;
+	}
+
+	for (const auto &rec : recs) {
+		Json::Value r;
+
+		r["pid"]         = static_cast<Json::Int>(rec.pid);
+		r["path"]        = rec.path;
+		r["status"]      = rec.status;
+		r["reaped"]      = rec.reaped;
+		r["started_us"]  = static_cast<Json::UInt64>(rec.started_us);
+		r["lifetime_us"] = static_cast<Json::UInt64>(rec.lifetime_us);
+		r["user_us"]     = static_cast<Json::UInt64>(rec.user_us);
+		r["sys_us"]      = static_cast<Json::UInt64>(rec.sys_us);
+		r["max_rss"]     = static_cast<Json::UInt64>(rec.max_rss);
+		r["minflt"]      = static_cast<Json::UInt64>(rec.minflt);
+		r["majflt"]      = static_cast<Json::UInt64>(rec.majflt);
+		r["nvcsw"]       = static_cast<Json::UInt64>(rec.nvcsw);
+		r["nivcsw"]      = static_cast<Json::UInt64>(rec.nivcsw);
+		r["inblock"]     = static_cast<Json::UInt64>(rec.inblock);
+		r["oublock"]     = static_cast<Json::UInt64>(rec.oublock);
+
+		Json::Value timeline(Json::arrayValue);
+
+		for (const auto &s : rec.timeline) {
+			Json::Value point(Json::arrayValue);
+			point.append(static_cast<Json::UInt64>(s.at_us));
+			point.append(static_cast<Json::UInt64>(s.rss));
+			point.append(static_cast<Json::UInt64>(s.cpu_us));
+			timeline.append(point);
+		}
+
+		r["timeline"] = timeline;
+
+		list.append(r);
+	}
+
+	for (const auto &rec : all) {
+		Json::Value &total = by_path[rec.path];
+
+		total["count"]       = total["count"].asUInt64() + 1;
+		total["user_us"]     = total["user_us"].asUInt64() + rec.user_us;
+		total["sys_us"]      = total["sys_us"].asUInt64() + rec.sys_us;
+		total["lifetime_us"] = total["lifetime_us"].asUInt64() + rec.lifetime_us;
+		total["inblock"]     = total["inblock"].asUInt64() + rec.inblock;
+		total["oublock"]     = total["oublock"].asUInt64() + rec.oublock;
+		total["max_rss"]     = std::max(total["max_rss"].asUInt64(), static_cast<Json::UInt64>(rec.max_rss));
+	}
+
+	result["live"]      = static_cast<Json::UInt64>(live);
+	result["untracked"] = static_cast<Json::UInt64>(untracked);
+	result["records"] = list;
+	result["by_path"] = by_path;
+
+	return result;
+}
+
+void accounting::clear() {
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	g_records.clear();
+	g_untracked = 0;
+}
+
+} // namespace daemonize
@@ -0,0 +1,457 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+#include <cctype>
+
+#include <daemon/cgroup.hpp>
+
+namespace daemonize {
+
+/**
+ * \brief   Find where unified hierarchy is mounted, "/sys/fs/cgroup" or "/sys/fs/cgroup/unified" on hybrid setups
+ */
+static std::string find_mount() {
+	std::string mount("/sys/fs/cgroup");
+
+	FILE *fp = setmntent("/proc/self/mounts", "re");
+	if (fp == nullptr) {
+		return mount;
+	}
+
+	struct mntent ent;
+	char buf[4096];
+
+	while (getmntent_r(fp, &ent, buf, sizeof(buf)) != nullptr) {
+		if (strcmp(ent.mnt_type, "cgroup2") == 0) {
+			mount = ent.mnt_dir;
+			break;
+		}
+	}
+
+	endmntent(fp);
+
+	return mount;
+}
+
+static const std::string &cgroup_mount() {
+	static const std::string mount(find_mount());
+
+	return mount;
+}
+
+static const char *const cgroup_controllers[] = {
+	"cpu",
+	"memory",
+	"io",
+	"pids",
+};
+
+/* leaf we move into when our own group has to enable controllers */
+static const char self_leaf[] = "self";
+
+static int write_file(const std::string &path, const std::string &value) {
+	int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	ssize_t wr = write(fd, value.data(), value.size());
+	int err = errno;
+
+	close(fd);
+
+	if (wr != static_cast<ssize_t>(value.size())) {
+		errno = wr < 0 ? err : EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int read_file(const std::string &path, std::string *out) {
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	char buf[4096];
+	ssize_t rd;
+
+	out->clear();
+
+	while ((rd = read(fd, buf, sizeof(buf))) != 0) {
+		if (rd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			int err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+
+		out->append(buf, static_cast<size_t>(rd));
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static void read_value(const std::string &path, uint64_t *value) {
+	std::string data;
+
+	if (read_file(path, &data) == 0) {
+		*value = strtoull(data.c_str(), nullptr, 10);
+	}
+}
+
+static void read_pressure(const std::string &path, cgroup_pressure *some, cgroup_pressure *full) {
+	std::string data;
+
+	if (read_file(path, &data) != 0) {
+		return;
+	}
+
+	const char *line = data.c_str();
+
+	while (*line) {
+		cgroup_pressure *p = nullptr;
+
+		if (strncmp(line, "some ", 5) == 0) {
+			p = some;
+		} else if (strncmp(line, "full ", 5) == 0) {
+			p = full;
+		}
+
+		if (p) {
+			sscanf(line + 5, "avg10=%lf avg60=%lf avg300=%lf total=%" SCNu64, &p->avg10, &p->avg60, &p->avg300, &p->total);
+		}
+
+		const char *nl = strchr(line, '\n');
+		if (nl == nullptr) {
+			break;
+		}
+
+		line = nl + 1;
+	}
+}
+
+/**
+ * \brief   Group of the process as of the first call. Relative paths stay anchored to it,
+ *          even after \ref cgroup::create() moved us into a leaf
+ */
+static std::string find_own() {
+	std::string data;
+
+	if (read_file("/proc/self/cgroup", &data) != 0) {
+		return std::string();
+	}
+
+	/* unified hierarchy entry is "0::/path" */
+	size_t pos = data.compare(0, 3, "0::") == 0 ? 0 : data.find("\n0::");
+	if (pos == std::string::npos) {
+		return std::string();
+	}
+
+	if (pos != 0) {
+		++pos;
+	}
+
+	size_t end = data.find('\n', pos);
+	std::string own(cgroup_mount() + data.substr(pos + 3, end == std::string::npos ? std::string::npos : end - pos - 3));
+
+	if (own.back() == '/') {
+		own.pop_back();
+	}
+
+	return own;
+}
+
+static const std::string &own_group() {
+	static const std::string own(find_own());
+
+	return own;
+}
+
+static bool has_word(const std::string &list, const char *word) {
+	size_t len = strlen(word);
+
+	for (size_t pos = list.find(word); pos != std::string::npos; pos = list.find(word, pos + 1)) {
+		bool begin = pos == 0 || isspace(static_cast<unsigned char>(list[pos - 1]));
+		bool end   = pos + len == list.size() || isspace(static_cast<unsigned char>(list[pos + len]));
+
+		if (begin && end) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * \brief   Enable for children of the group those of cpu, memory, io and pids controllers
+ *          which are available to it
+ */
+static int enable_controllers(const std::string &dir) {
+	std::string available;
+	std::string enabled;
+
+	if (read_file(dir + "/cgroup.controllers", &available) != 0 ||
+	    read_file(dir + "/cgroup.subtree_control", &enabled) != 0) {
+		return -1;
+	}
+
+	for (const char *ctl : cgroup_controllers) {
+		if (!has_word(available, ctl) || has_word(enabled, ctl)) {
+			continue;
+		}
+
+		if (write_file(dir + "/cgroup.subtree_control", std::string("+") + ctl) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int cgroup::resolve(const std::string &path, std::string *abs) {
+	const std::string &mount = cgroup_mount();
+
+	/* whole components only, /sys/fs/cgroupX is not under /sys/fs/cgroup */
+	if (path.compare(0, mount.size(), mount) == 0 && (path.size() == mount.size() || path[mount.size()] == '/')) {
+		*abs = path;
+		return 0;
+	}
+
+	if (!path.empty() && path[0] == '/') {
+		*abs = mount + path;
+		return 0;
+	}
+
+	const std::string &own = own_group();
+
+	if (own.empty()) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*abs = own + "/" + path;
+
+	return 0;
+}
+
+int cgroup::create(const std::string &path) {
+	std::string abs;
+
+	if (resolve(path, &abs) != 0) {
+		return -1;
+	}
+
+	/* deepest existing ancestor */
+	std::string base(abs);
+	struct stat sb = {};
+
+	while (stat(base.c_str(), &sb) != 0) {
+		size_t slash = base.rfind('/');
+
+		if (errno != ENOENT || slash == std::string::npos || base.size() <= cgroup_mount().size()) {
+			return -1;
+		}
+
+		base.erase(slash);
+	}
+
+	if (base == abs) {
+		return 0;
+	}
+
+	/*
+	 * existing groups are touched only inside of our own subtree, which is delegated to us.
+	 * Group with processes can't enable controllers (no internal process rule),
+	 * so we move out of our own group into a leaf first
+	 */
+	const std::string &own = own_group();
+
+	if (!own.empty() && base.compare(0, own.size(), own) == 0 && (base.size() == own.size() || base[own.size()] == '/')) {
+		if (enable_controllers(base) != 0) {
+			if (errno != EBUSY || base != own) {
+				return -1;
+			}
+
+			std::string leaf(own + "/" + self_leaf);
+
+			if ((mkdir(leaf.c_str(), 0755) != 0 && errno != EEXIST) ||
+			    write_file(leaf + "/cgroup.procs", "0") != 0 ||
+			    enable_controllers(base) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	std::string dir(base);
+	size_t pos = base.size();
+
+	while (pos < abs.size()) {
+		size_t next = abs.find('/', pos + 1);
+		if (next == std::string::npos) {
+			next = abs.size();
+		}
+
+		std::string component = abs.substr(pos, next - pos);
+		pos = next;
+
+		if (component == "/") {
+			continue;
+		}
+
+		dir += component;
+
+		if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+			return -1;
+		}
+
+		if (pos < abs.size() && enable_controllers(dir) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int cgroup::open(const std::string &path) {
+	std::string abs;
+
+	if (resolve(path, &abs) != 0) {
+		return -1;
+	}
+
+	return ::open(abs.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+int cgroup::apply(const std::string &path, const cgroup_limits &limits) {
+	std::string abs;
+
+	if (resolve(path, &abs) != 0) {
+		return -1;
+	}
+
+	const struct {
+		const char        *knob;
+		const std::string &value;
+	} knobs[] = {
+		{"/cpu.max",     limits.cpu_max},
+		{"/cpu.weight",  limits.cpu_weight},
+		{"/memory.high", limits.memory_high},
+		{"/memory.max",  limits.memory_max},
+		{"/io.weight",   limits.io_weight},
+		{"/pids.max",    limits.pids_max},
+	};
+
+	for (const auto &k : knobs) {
+		if (!k.value.empty() && write_file(abs + k.knob, k.value) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int cgroup::attach(const std::string &path, pid_t pid) {
+	std::string abs;
+
+	if (resolve(path, &abs) != 0) {
+		return -1;
+	}
+
+	return write_file(abs + "/cgroup.procs", std::to_string(pid));
+}
+
+int cgroup::stats(const std::string &path, cgroup_stats *st) {
+	std::string abs;
+
+	if (resolve(path, &abs) != 0) {
+		return -1;
+	}
+
+	struct stat sb = {};
+	if (stat(abs.c_str(), &sb) != 0) {
+		return -1;
+	}
+
+	*st = cgroup_stats();
+
+	std::string data;
+
+	if (read_file(abs + "/cpu.stat", &data) == 0) {
+		const struct {
+			const char *key;
+			uint64_t   *value;
+		} keys[] = {
+			{"usage_usec",     &st->cpu_usage_usec},
+			{"user_usec",      &st->cpu_user_usec},
+			{"system_usec",    &st->cpu_system_usec},
+			{"nr_throttled",   &st->nr_throttled},
+			{"throttled_usec", &st->throttled_usec},
+		};
+
+		const char *line = data.c_str();
+
+		while (*line) {
+			for (const auto &k : keys) {
+				size_t len = strlen(k.key);
+
+				if (strncmp(line, k.key, len) == 0 && line[len] == ' ') {
+					*k.value = strtoull(line + len + 1, nullptr, 10);
+					break;
+				}
+			}
+
+			const char *nl = strchr(line, '\n');
+			if (nl == nullptr) {
+				break;
+			}
+
+			line = nl + 1;
+		}
+	}
+
+	read_value(abs + "/memory.current", &st->memory_current);
+	read_value(abs + "/memory.peak", &st->memory_peak);
+	read_value(abs + "/pids.current", &st->pids_current);
+
+	read_pressure(abs + "/cpu.pressure", &st->cpu_some, &st->cpu_full);
+	read_pressure(abs + "/memory.pressure", &st->memory_some, &st->memory_full);
+	read_pressure(abs + "/io.pressure", &st->io_some, &st->io_full);
+
+	return 0;
+}
+
+} // namespace daemonize
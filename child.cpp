@@ -18,44 +18,214 @@
  */
 
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+#include <cerrno>
+
 #include <daemon/daemonize.hpp>
+#include <daemon/accounting.hpp>
 #include <daemon/utils.hpp>
 
 
 namespace daemonize {
 
-pid_t child::execute(const char *path, const char * const argv[], const char * const envv[]) {
-	pid_t pid = make();
+/**
+ * \brief   Open descriptors for one of child's output streams
+ *
+ * \param[in]   mode
+ * \param[in]   name   - memfd name
+ * \param[out]  child_fd  - descriptor to be installed in the child, -1 if inherited
+ * \param[out]  parent_fd - descriptor returned to the caller, -1 if none
+ *
+ * \return 0 on success, -1 otherwise
+ */
+static int open_stdio(stdio_mode mode, const char *name, int *child_fd, int *parent_fd) {
+	*child_fd  = -1;
+	*parent_fd = -1;
 
-	if (pid > 0 || pid < 0) {
-		return pid;
+	switch (mode) {
+	case stdio_mode::inherit:
+		break;
+	case stdio_mode::null:
+		*child_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (*child_fd < 0) {
+			return -1;
+		}
+		break;
+	case stdio_mode::pipe: {
+		int fds[2];
+
+		if (pipe2(fds, O_CLOEXEC) != 0) {
+			return -1;
+		}
+
+		*parent_fd = fds[0];
+		*child_fd  = fds[1];
+		break;
 	}
+	case stdio_mode::memfd:
+		/* same file on both sides, parent reads it from offset 0 once child is done */
+		*child_fd = memfd_create(name, MFD_CLOEXEC);
+		if (*child_fd < 0) {
+			return -1;
+		}
 
-	/* execute requested program */
-	if (envv) {
-		execve(path, const_cast<char * const *>(argv), const_cast<char * const *>(envv));
-	} else {
-		execv(path, const_cast<char * const *>(argv));
+		*parent_fd = *child_fd;
+		break;
+	}
+
+	return 0;
+}
+
+static void close_stdio(int child_fd, int parent_fd, bool keep_parent) {
+	if (child_fd >= 0 && child_fd != parent_fd) {
+		close(child_fd);
+	}
+
+	if (!keep_parent && parent_fd >= 0) {
+		close(parent_fd);
+	}
+}
+
+/**
+ * \brief   Pass errno of failed child to the parent and terminate
+ */
+static void fail(int status_fd) {
+	int err = errno;
+
+	if (write(status_fd, &err, sizeof(err)) < 0) {
+		// nothing to do, parent sees EOF and child exit status
 	}
 
-	// execv*() doesn't return, if successful
 	_exit(EXIT_FAILURE);
 }
 
-pid_t child::make() {
+pid_t child::execute(const char *path, const char * const argv[], const char * const envv[], spawn_opts *opts) {
+	int status[2];
+
+	/* closed by exec, so EOF on read end means child is running requested program */
+	if (pipe2(status, O_CLOEXEC) != 0) {
+		return -1;
+	}
+
+	pid_t pid = make(opts, status[1]);
+
+	if (pid == 0) {
+		/* execute requested program */
+		if (envv) {
+			execve(path, const_cast<char * const *>(argv), const_cast<char * const *>(envv));
+		} else {
+			execv(path, const_cast<char * const *>(argv));
+		}
+
+		// execv*() doesn't return, if successful
+		fail(status[1]);
+	}
+
+	int err = errno;
+
+	close(status[1]);
+
+	if (pid > 0) {
+		ssize_t rd;
+
+		/* tracked before the child may exit, so concurrent accounting::wait() records it */
+		accounting::track(pid, path);
+
+		while ((rd = read(status[0], &err, sizeof(err))) < 0 && errno == EINTR) {
+		}
+
+		if (rd == sizeof(err)) {
+			/* child failed before or at exec */
+			accounting::untrack(pid);
+
+			while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+			}
+
+			if (opts) {
+				close_stdio(-1, opts->out_fd, false);
+				close_stdio(-1, opts->err_fd, false);
+
+				opts->out_fd = -1;
+				opts->err_fd = -1;
+			}
+
+			pid = -1;
+		}
+	}
+
+	close(status[0]);
+
+	errno = err;
+
+	return pid;
+}
+
+pid_t child::make(spawn_opts *opts, int status_fd) {
 	pid_t pid;
 
-	pid = fork();
+	int out_child = -1;
+	int out_parent = -1;
+	int err_child = -1;
+	int err_parent = -1;
+
+	if (opts) {
+		opts->out_fd = -1;
+		opts->err_fd = -1;
+
+		if (open_stdio(opts->out, "daemonize:stdout", &out_child, &out_parent) != 0) {
+			return -1;
+		}
+
+		if (open_stdio(opts->err, "daemonize:stderr", &err_child, &err_parent) != 0) {
+			int err = errno;
+			close_stdio(out_child, out_parent, false);
+			errno = err;
+			return -1;
+		}
+	}
+
+	if (opts && opts->cgroup_fd >= 0) {
+		pid = fork_into_cgroup(opts->cgroup_fd);
+	} else {
+		pid = fork();
+	}
 
 	if (pid == 0) {
+		/* only async-signal-safe calls from here on, parent may be multithreaded */
+
+		/* dup2() drops O_CLOEXEC on the target, so streams survive exec */
+		if (out_child >= 0 && dup2(out_child, STDOUT_FILENO) < 0) {
+			fail(status_fd);
+		}
+
+		if (err_child >= 0 && dup2(err_child, STDERR_FILENO) < 0) {
+			fail(status_fd);
+		}
+
 		// Close all of file descriptors
-		if (close_derived_fds() != 0) {
-			_exit(EXIT_FAILURE);
+		if (close_derived_fds(status_fd) != 0) {
+			fail(status_fd);
 		}
+
+		return pid;
 	}
 
+	int err = errno;
+
+	close_stdio(out_child, out_parent, pid > 0);
+	close_stdio(err_child, err_parent, pid > 0);
+
+	if (pid > 0 && opts) {
+		opts->out_fd = out_parent;
+		opts->err_fd = err_parent;
+	}
+
+	errno = err;
+
 	return pid;
 }
 
@@ -0,0 +1,326 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <daemon/collector.hpp>
+
+namespace daemonize {
+
+/* one read per ready stream and poll keeps busy children from starving the rest */
+static const size_t read_chunk  = 64 * 1024;
+static const int    max_events  = 256;
+
+collector::collector()
+	: epfd_(epoll_create1(EPOLL_CLOEXEC))
+	, buf_(read_chunk)
+{}
+
+collector::~collector() {
+	for (auto &it : streams_) {
+		close(it.first);
+	}
+
+	if (epfd_ >= 0) {
+		close(epfd_);
+	}
+}
+
+int collector::add(job_id id, int fd, const capture_opts &opts) {
+	if (epfd_ < 0) {
+		close(fd);
+		errno = EBADF;
+		return -1;
+	}
+
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	epoll_event ev = {};
+	ev.events  = EPOLLIN;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	stream &s = streams_[fd];
+	s.job    = id;
+	s.lines  = opts.lines;
+	s.prefix = opts.prefix;
+	s.partial.clear();
+	s.discard = false;
+
+	auto it = jobs_.find(id);
+	if (it == jobs_.end()) {
+		job &j = jobs_[id];
+		j.max_bytes = opts.max_bytes;
+		j.fds.push_back(fd);
+	} else {
+		it->second.out.eof = false;
+		it->second.fds.push_back(fd);
+	}
+
+	return 0;
+}
+
+int collector::poll(int timeout_ms) {
+	epoll_event events[max_events];
+
+	int count = epoll_wait(epfd_, events, max_events, timeout_ms);
+	if (count < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		int fd = events[i].data.fd;
+
+		auto sit = streams_.find(fd);
+		if (sit == streams_.end()) {
+			continue;
+		}
+
+		ssize_t rd = read(fd, buf_.data(), buf_.size());
+
+		if (rd > 0) {
+			consume(sit->second, jobs_[sit->second.job], buf_.data(), static_cast<size_t>(rd));
+		} else if (rd == 0 || (errno != EAGAIN && errno != EINTR)) {
+			close_stream(fd);
+		}
+	}
+
+	return count;
+}
+
+bool collector::take(job_id id, capture_output *out) {
+	auto it = jobs_.find(id);
+	if (it == jobs_.end()) {
+		return false;
+	}
+
+	capture_output &o = it->second.out;
+
+	out->data.swap(o.data);
+	out->dropped = o.dropped;
+	out->eof     = o.eof;
+
+	o.data.clear();
+	o.dropped = 0;
+
+	if (out->eof) {
+		jobs_.erase(it);
+	}
+
+	return true;
+}
+
+void collector::remove(job_id id) {
+	auto it = jobs_.find(id);
+	if (it == jobs_.end()) {
+		return;
+	}
+
+	for (int fd : it->second.fds) {
+		epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+		close(fd);
+		streams_.erase(fd);
+	}
+
+	jobs_.erase(it);
+}
+
+void collector::consume(stream &s, job &j, const char *data, size_t len) {
+	if (!s.lines) {
+		append(s, j, data, len);
+		return;
+	}
+
+	const char *end = data + len;
+
+	while (data < end) {
+		const char *nl = static_cast<const char *>(memchr(data, '\n', static_cast<size_t>(end - data)));
+
+		/* tail of the line which was cut, it's newline was emitted with the cut part */
+		if (s.discard) {
+			if (nl == nullptr) {
+				j.out.dropped += static_cast<size_t>(end - data);
+				break;
+			}
+
+			j.out.dropped += static_cast<size_t>(nl - data);
+			s.discard = false;
+			data = nl + 1;
+			continue;
+		}
+
+		if (nl == nullptr) {
+			s.partial.append(data, static_cast<size_t>(end - data));
+
+			/* unterminated line reaching the cap is cut to what fits, the rest of it is dropped */
+			if (s.partial.size() >= j.max_bytes) {
+				flush_partial(s, j);
+				s.discard = true;
+			}
+			break;
+		}
+
+		++nl;
+
+		if (s.partial.empty()) {
+			append(s, j, data, static_cast<size_t>(nl - data));
+		} else {
+			s.partial.append(data, static_cast<size_t>(nl - data));
+			append(s, j, s.partial.data(), s.partial.size());
+			s.partial.clear();
+		}
+
+		data = nl;
+	}
+}
+
+void collector::append(const stream &s, job &j, const char *data, size_t len) {
+	std::string &buf = j.out.data;
+	size_t prefix = s.lines ? s.prefix.size() : 0;
+
+	if (buf.size() + prefix + len > j.max_bytes) {
+		if (s.lines) {
+			/* whole line or nothing */
+			j.out.dropped += len;
+			return;
+		}
+
+		size_t room = j.max_bytes - buf.size();
+		j.out.dropped += len - room;
+		len = room;
+	}
+
+	if (prefix) {
+		buf.append(s.prefix);
+	}
+
+	buf.append(data, len);
+}
+
+void collector::flush_partial(stream &s, job &j) {
+	if (s.partial.empty()) {
+		return;
+	}
+
+	std::string &buf = j.out.data;
+	size_t used = buf.size() + s.prefix.size() + 1;
+	size_t room = used < j.max_bytes ? j.max_bytes - used : 0;
+
+	if (room == 0) {
+		j.out.dropped += s.partial.size();
+	} else {
+		size_t len = s.partial.size() < room ? s.partial.size() : room;
+
+		j.out.dropped += s.partial.size() - len;
+
+		buf.append(s.prefix);
+		buf.append(s.partial, 0, len);
+		buf.push_back('\n');
+	}
+
+	s.partial.clear();
+}
+
+void collector::close_stream(int fd) {
+	auto sit = streams_.find(fd);
+
+	epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+
+	if (sit == streams_.end()) {
+		return;
+	}
+
+	auto jit = jobs_.find(sit->second.job);
+
+	if (jit != jobs_.end()) {
+		job &j = jit->second;
+
+		flush_partial(sit->second, j);
+
+		for (auto it = j.fds.begin(); it != j.fds.end(); ++it) {
+			if (*it == fd) {
+				j.fds.erase(it);
+				break;
+			}
+		}
+
+		if (j.fds.empty()) {
+			j.out.eof = true;
+		}
+	}
+
+	streams_.erase(sit);
+}
+
+ssize_t read_memfd(int fd, std::string *out, size_t max_bytes) {
+	struct stat st = {};
+
+	if (fstat(fd, &st) != 0) {
+		return -1;
+	}
+
+	size_t size = static_cast<size_t>(st.st_size);
+	size_t want = size < max_bytes ? size : max_bytes;
+
+	out->resize(want);
+
+	size_t done = 0;
+
+	while (done < want) {
+		ssize_t rd = pread(fd, &(*out)[done], want - done, static_cast<off_t>(done));
+
+		if (rd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		if (rd == 0) {
+			break;
+		}
+
+		done += static_cast<size_t>(rd);
+	}
+
+	out->resize(done);
+
+	return static_cast<ssize_t>(size);
+}
+
+} // namespace daemonize
@@ -0,0 +1,651 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <daemon/daemonize.hpp>
+#include <daemon/control.hpp>
+#include <daemon/accounting.hpp>
+
+namespace daemonize {
+
+static const size_t max_connections = 64;
+static const size_t max_request     = 4096;
+static const size_t max_reply_queue = 64 * 1024;
+
+struct handler {
+	control_cb cb;
+	void      *ctx;
+};
+
+struct connection {
+	std::string in;
+	std::string out;
+};
+
+typedef std::chrono::steady_clock clock_type;
+
+static std::mutex                                     g_mutex;
+static std::map<std::string, handler>                 g_handlers;
+static std::vector<std::pair<std::string, uint64_t>>  g_phases;
+static clock_type::time_point                         g_started;
+static std::thread                                   *g_thread    = nullptr;
+static int                                            g_listen_fd = -1;
+static int                                            g_event_fd  = -1;
+static std::string                                    g_path;
+
+static uint64_t elapsed_us(clock_type::time_point since) {
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - since).count());
+}
+
+static uint64_t count_entries(const char *path) {
+	uint64_t count = 0;
+
+	DIR *dir = opendir(path);
+	if (dir == nullptr) {
+		return 0;
+	}
+
+	while (dirent *ent = readdir(dir)) {
+		if (ent->d_name[0] != '.') {
+			++count;
+		}
+	}
+
+	closedir(dir);
+
+	return count;
+}
+
+static uint64_t count_children() {
+	uint64_t count = 0;
+
+	DIR *dir = opendir("/proc/self/task");
+	if (dir == nullptr) {
+		return 0;
+	}
+
+	while (dirent *ent = readdir(dir)) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+
+		std::string path("/proc/self/task/");
+		path.append(ent->d_name);
+		path.append("/children");
+
+		FILE *fp = fopen(path.c_str(), "re");
+		if (fp == nullptr) {
+			continue;
+		}
+
+		unsigned long pid;
+		while (fscanf(fp, "%lu", &pid) == 1) {
+			++count;
+		}
+
+		fclose(fp);
+	}
+
+	closedir(dir);
+
+	return count;
+}
+
+static int status_cmd(const Json::Value &, Json::Value *reply, void *) {
+	Json::Value phases(Json::arrayValue);
+	uint64_t uptime;
+
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+
+		uptime = elapsed_us(g_started);
+
+		for (const auto &p : g_phases) {
+			Json::Value phase;
+			phase["name"] = p.first;
+			phase["us"]   = static_cast<Json::UInt64>(p.second);
+			phases.append(phase);
+		}
+	}
+
+	(*reply)["pid"]       = static_cast<Json::Int>(getpid());
+	(*reply)["uptime_ms"] = static_cast<Json::UInt64>(uptime / 1000);
+	(*reply)["phases"]    = phases;
+
+	/* minus descriptor of the directory itself */
+	uint64_t fds = count_entries("/proc/self/fd");
+	(*reply)["fds"]      = static_cast<Json::UInt64>(fds > 0 ? fds - 1 : 0);
+	(*reply)["children"] = static_cast<Json::UInt64>(count_children());
+	(*reply)["threads"]  = static_cast<Json::UInt64>(count_entries("/proc/self/task"));
+
+	Json::Value memory;
+	uint64_t size = 0;
+	uint64_t resident = 0;
+	uint64_t shared = 0;
+	uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+
+	FILE *fp = fopen("/proc/self/statm", "re");
+	if (fp) {
+		if (fscanf(fp, "%lu %lu %lu", &size, &resident, &shared) != 3) {
+			size = resident = shared = 0;
+		}
+		fclose(fp);
+	}
+
+	rusage usage = {};
+	getrusage(RUSAGE_SELF, &usage);
+
+	memory["vsize"]    = static_cast<Json::UInt64>(size * page);
+	memory["rss"]      = static_cast<Json::UInt64>(resident * page);
+	memory["shared"]   = static_cast<Json::UInt64>(shared * page);
+	memory["peak_rss"] = static_cast<Json::UInt64>(usage.ru_maxrss) * 1024;
+
+	(*reply)["memory"] = memory;
+
+	return 0;
+}
+
+static int reopen_logs_cmd(const Json::Value &, Json::Value *reply, void *) {
+	if (reopen_logs() != 0) {
+		(*reply)["error"] = strerror(errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int signal_cmd(const Json::Value &, Json::Value *reply, void *ctx) {
+	if (kill(getpid(), static_cast<int>(reinterpret_cast<intptr_t>(ctx))) != 0) {
+		(*reply)["error"] = strerror(errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int reload_cmd(const Json::Value &request, Json::Value *reply, void *) {
+	if (reload() == 0) {
+		return 0;
+	}
+
+	/* no config loader, leave it to the application */
+	if (errno == ENOSYS) {
+		return signal_cmd(request, reply, reinterpret_cast<void *>(SIGHUP));
+	}
+
+	(*reply)["error"] = strerror(errno);
+
+	return -1;
+}
+
+static int accounting_cmd(const Json::Value &request, Json::Value *reply, void *) {
+	const Json::Value &top = request.get("top", 10);
+
+	if (!top.isUInt()) {
+		(*reply)["error"] = "\"top\" must be non-negative integer";
+		return -1;
+	}
+
+	(*reply)["accounting"] = accounting::dump(top.asUInt());
+
+	return 0;
+}
+
+static const struct {
+	const char *cmd;
+	handler     h;
+} builtins[] = {
+	{"status",        {status_cmd,      nullptr}},
+	{"reopen-logs",   {reopen_logs_cmd, nullptr}},
+	{"reload",        {reload_cmd,      nullptr}},
+	{"graceful-stop", {signal_cmd,      reinterpret_cast<void *>(SIGTERM)}},
+	{"accounting",    {accounting_cmd,  nullptr}},
+};
+
+static std::string dispatch(const std::string &line) {
+	Json::Value request;
+	Json::Value reply(Json::objectValue);
+
+	if (!line.empty() && line[0] == '{') {
+		Json::CharReaderBuilder builder;
+		std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+		std::string errors;
+
+		if (!reader->parse(line.data(), line.data() + line.size(), &request, &errors) ||
+		    !request.isObject() || !request["cmd"].isString()) {
+			request = Json::Value(Json::objectValue);
+			reply["error"] = "malformed request";
+		}
+	} else {
+		request["cmd"] = line;
+	}
+
+	std::string cmd(request["cmd"].isString() ? request["cmd"].asString() : std::string());
+	handler h = {nullptr, nullptr};
+
+	if (!reply.isMember("error")) {
+		std::lock_guard<std::mutex> lock(g_mutex);
+
+		auto it = g_handlers.find(cmd);
+		if (it != g_handlers.end()) {
+			h = it->second;
+		}
+	}
+
+	if (h.cb == nullptr && !reply.isMember("error")) {
+		for (const auto &b : builtins) {
+			if (cmd == b.cmd) {
+				h = b.h;
+				break;
+			}
+		}
+	}
+
+	int rc = -1;
+
+	if (h.cb) {
+		/* nothing may escape into serving thread */
+		try {
+			rc = h.cb(request, &reply, h.ctx);
+		} catch (const std::exception &e) {
+			reply["error"] = e.what();
+			rc = -1;
+		} catch (...) {
+			reply["error"] = "command failed";
+			rc = -1;
+		}
+	} else if (!reply.isMember("error")) {
+		reply["error"] = "unknown command";
+	}
+
+	reply["ok"]  = rc == 0;
+	reply["cmd"] = cmd;
+
+	Json::StreamWriterBuilder builder;
+	builder["indentation"] = "";
+
+	return Json::writeString(builder, reply) + "\n";
+}
+
+/**
+ * \return false if connection must be closed
+ */
+static bool flush(int fd, connection &conn) {
+	while (!conn.out.empty()) {
+		ssize_t wr = send(fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+
+		if (wr < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		conn.out.erase(0, static_cast<size_t>(wr));
+	}
+
+	return true;
+}
+
+/**
+ * \return false if connection must be closed
+ */
+static bool process(int fd, connection &conn) {
+	char buf[1024];
+
+	for (;;) {
+		ssize_t rd = recv(fd, buf, sizeof(buf), 0);
+
+		if (rd == 0) {
+			flush(fd, conn);
+			return false;
+		}
+
+		if (rd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+
+			return false;
+		}
+
+		conn.in.append(buf, static_cast<size_t>(rd));
+
+		size_t pos;
+		while ((pos = conn.in.find('\n')) != std::string::npos) {
+			std::string line(conn.in, 0, pos);
+			conn.in.erase(0, pos + 1);
+
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+
+			if (!line.empty()) {
+				conn.out += dispatch(line);
+			}
+		}
+
+		if (!flush(fd, conn)) {
+			return false;
+		}
+
+		/* client does not read replies or sends garbage */
+		if (conn.in.size() > max_request || conn.out.size() > max_reply_queue) {
+			return false;
+		}
+	}
+
+	return flush(fd, conn);
+}
+
+static void serve(int listen_fd, int event_fd) {
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		return;
+	}
+
+	epoll_event ev = {};
+	ev.events  = EPOLLIN;
+	ev.data.fd = listen_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	ev.data.fd = event_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, event_fd, &ev);
+
+	std::unordered_map<int, connection> conns;
+	bool running = true;
+
+	while (running) {
+		epoll_event events[32];
+
+		int count = epoll_wait(epfd, events, 32, -1);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (int i = 0; i < count; ++i) {
+			int fd = events[i].data.fd;
+
+			if (fd == event_fd) {
+				running = false;
+				break;
+			}
+
+			if (fd == listen_fd) {
+				int conn_fd;
+
+				while ((conn_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					if (conns.size() >= max_connections) {
+						close(conn_fd);
+						continue;
+					}
+
+					ev.events  = EPOLLIN;
+					ev.data.fd = conn_fd;
+
+					if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn_fd, &ev) != 0) {
+						close(conn_fd);
+						continue;
+					}
+
+					conns[conn_fd];
+				}
+				continue;
+			}
+
+			auto it = conns.find(fd);
+			if (it == conns.end()) {
+				continue;
+			}
+
+			bool keep;
+
+			if (events[i].events & EPOLLIN) {
+				keep = process(fd, it->second);
+			} else if (events[i].events & EPOLLOUT) {
+				keep = flush(fd, it->second);
+			} else {
+				keep = false;
+			}
+
+			if (!keep) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+				close(fd);
+				conns.erase(it);
+				continue;
+			}
+
+			/* wait for writability only while replies are queued */
+			ev.events  = it->second.out.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT);
+			ev.data.fd = fd;
+			epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+		}
+	}
+
+	for (auto &c : conns) {
+		close(c.first);
+	}
+
+	close(epfd);
+}
+
+/**
+ * \brief   Remove socket file left by a dead process
+ *
+ * \return 0 if path is free now, -1 otherwise and errno is set, EADDRINUSE if a process serves it
+ */
+static int remove_stale(const sockaddr_un &addr) {
+	struct stat st = {};
+
+	if (lstat(addr.sun_path, &st) != 0) {
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	/* never remove anything but a socket */
+	if (!S_ISSOCK(st.st_mode)) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int rc = connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+	int err = errno;
+
+	close(fd);
+
+	if (rc == 0) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+
+	if (err != ECONNREFUSED) {
+		errno = err;
+		return -1;
+	}
+
+	return unlink(addr.sun_path) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+int control::start(const std::string &path) {
+	sockaddr_un addr = {};
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (g_thread) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		return -1;
+	}
+
+	if (remove_stale(addr) != 0) {
+		int err = errno;
+		close(listen_fd);
+		errno = err;
+		return -1;
+	}
+
+	if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+		int err = errno;
+		close(listen_fd);
+		errno = err;
+		return -1;
+	}
+
+	/* commands stop and reconfigure the daemon, owner only. Nobody can connect before listen() */
+	if (chmod(path.c_str(), 0600) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+		int err = errno;
+		close(listen_fd);
+		unlink(path.c_str());
+		errno = err;
+		return -1;
+	}
+
+	int event_fd = eventfd(0, EFD_CLOEXEC);
+	if (event_fd < 0) {
+		int err = errno;
+		close(listen_fd);
+		unlink(path.c_str());
+		errno = err;
+		return -1;
+	}
+
+	/* serving thread inherits mask, signals are left for the application */
+	sigset_t all;
+	sigset_t old;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	try {
+		g_thread = new std::thread(serve, listen_fd, event_fd);
+	} catch (const std::exception &e) {
+		pthread_sigmask(SIG_SETMASK, &old, nullptr);
+		close(event_fd);
+		close(listen_fd);
+		unlink(path.c_str());
+		errno = EAGAIN;
+		return -1;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+	g_listen_fd = listen_fd;
+	g_event_fd  = event_fd;
+	g_path      = path;
+
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+
+		/* uptime counts from here if no phase was recorded */
+		if (g_started == clock_type::time_point()) {
+			g_started = clock_type::now();
+		}
+	}
+
+	return 0;
+}
+
+void control::stop() {
+	if (g_thread == nullptr) {
+		return;
+	}
+
+	uint64_t one = 1;
+
+	if (write(g_event_fd, &one, sizeof(one)) == sizeof(one) && g_thread->get_id() != std::this_thread::get_id()) {
+		g_thread->join();
+	} else {
+		g_thread->detach();
+	}
+
+	delete g_thread;
+	g_thread = nullptr;
+
+	close(g_listen_fd);
+	close(g_event_fd);
+	unlink(g_path.c_str());
+
+	g_listen_fd = -1;
+	g_event_fd  = -1;
+}
+
+void control::handle(const std::string &cmd, control_cb cb, void *ctx) {
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	if (cb) {
+		g_handlers[cmd] = handler{cb, ctx};
+	} else {
+		g_handlers.erase(cmd);
+	}
+}
+
+void control::phase(const char *name) {
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	if (g_started == clock_type::time_point()) {
+		g_started = clock_type::now();
+	}
+
+	g_phases.emplace_back(name, elapsed_us(g_started));
+}
+
+} // namespace daemonize
@@ -21,15 +21,21 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
+#include <dirent.h>
 
 #include <unistd.h>
 
 #include <string>
 #include <iostream>
-#include <fstream>
+#include <mutex>
+#include <map>
 
 #include <boost/filesystem.hpp>
 #include <daemon/daemonize.hpp>
+#include <daemon/cgroup.hpp>
+#include <daemon/control.hpp>
+#include <daemon/instance.hpp>
+#include <daemon/utils.hpp>
 
 namespace daemonize {
 
@@ -37,8 +43,24 @@ static Json::Value *g_config = nullptr;
 static int *g_lock_fd        = nullptr;
 static cleanup_cb cleanup    = nullptr;
 static void *cleanup_ctx     = nullptr;
+static std::mutex g_mutex;
+static config_loader_cb g_loader = nullptr;
+static void *g_loader_ctx        = nullptr;
+static int g_instance_fd         = -1;
+
+static std::string instance_dir(const Json::Value &config) {
+	std::string dir(config["instance"].get("dir", config["env_dir"]).asString());
+
+	if (dir.substr(0, 1) != "/") {
+		dir = config["env_dir"].asString() + "/" + dir;
+	}
+
+	return dir;
+}
 
 void exit_daemon(int err) {
+	control::stop();
+
 	if (cleanup) {
 		cleanup(cleanup_ctx);
 	}
@@ -55,11 +77,21 @@ void exit_daemon(int err) {
 		delete g_lock_fd;
 	}
 
-	if (!g_config->operator[]("pid_file").empty()) {
-		unlink(g_config->operator[]("pid_file").asString().c_str());
-	}
+	/* config is taken over after checks and lock file, failures before that have nothing to clean */
+	if (g_config != nullptr) {
+		if (g_instance_fd >= 0) {
+			const Json::Value &inst = g_config->operator[]("instance");
+			instance::release(instance_dir(*g_config), inst["name"].asString(), inst["index"].asUInt(), g_instance_fd);
+			g_instance_fd = -1;
+		}
 
-	delete g_config;
+		if (!g_config->operator[]("pid_file").empty()) {
+			unlink(g_config->operator[]("pid_file").asString().c_str());
+		}
+
+		delete g_config;
+		g_config = nullptr;
+	}
 
 	_exit(err);
 }
@@ -81,13 +113,16 @@ static int already_running(const std::string &lock_file) {
 	return fd;
 }
 
-static void write_pid(const std::string &pid_file) {
-	try {
-		std::ofstream file(pid_file, std::ios_base::trunc);
-		file << std::to_string(getpid());
-	} catch (const std::exception &e) {
-		exit_daemon(EXIT_FAILURE);
+static int write_pid(const std::string &pid_file) {
+	std::string pid(std::to_string(getpid()));
+
+	// readers never see empty or partially written file
+	if (write_file_atomic(pid_file, pid.data(), pid.size()) != 0) {
+		fprintf(stderr, "Unable to write pid file: [%s]. Error: %s\n", pid_file.c_str(), strerror(errno));
+		return -1;
 	}
+
+	return 0;
 }
 
 static void verify_config(Json::Value *config) {
@@ -102,140 +137,584 @@ static void verify_config(Json::Value *config) {
 	}
 }
 
-pid_t make_daemon(Json::Value *config, cleanup_cb cb, void *userdata) {
-	verify_config(config);
+/**
+ * \brief   Redirect standard streams according to io_mode of the config
+ *          Target is opened first and then put in place with dup2(), so stream is never left closed
+ *
+ * \param[in]  config
+ * \param[in]  flags  - O_TRUNC on startup, O_APPEND to reopen
+ *
+ * \return 0 on success, -1 otherwise
+ */
+static int redirect_stdio(const Json::Value &config, int flags) {
+	const Json::Value &io_config =
+		config["io_mode"].asString() == std::string("io_daemon") ? config["io_daemon"] : config["io_debug"];
+
+	const struct {
+		const char *name;
+		int         fd;
+		int         flags;
+	} streams[] = {
+		{"stdin",  STDIN_FILENO,  O_RDONLY},
+		{"stdout", STDOUT_FILENO, O_CREAT | O_WRONLY | flags},
+		{"stderr", STDERR_FILENO, O_CREAT | O_WRONLY | flags},
+	};
+
+	for (const auto &stream : streams) {
+		std::string target(io_config[stream.name].asString());
+
+		if (target == stream.name) {
+			// no redirection needed
+			continue;
+		}
 
-	int lock_fd = 0;
-	if (config->isMember("lock_file")) {
-		lock_fd = already_running(config->operator[]("lock_file").asString());
+		std::string std_file;
+
+		if (target.compare("/dev/null") == 0) {
+			std_file = "/dev/null";
+		} else {
+			std_file = config["log"]["dir"].asString();
+			std_file.append("/");
+			std_file.append(target);
+		}
+
+		int fd = open(std_file.c_str(), stream.flags | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "Unable to redirect %s to: %s. Error: %s\n", stream.name, std_file.c_str(), strerror(errno));
+			return -1;
+		}
+
+		if (dup2(fd, stream.fd) < 0) {
+			fprintf(stderr, "Unable to redirect %s to: %s. Error: %s\n", stream.name, std_file.c_str(), strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		close(fd);
+
+		if (stream.fd != STDIN_FILENO && std_file.compare("/dev/null") != 0) {
+			if (chmod(std_file.c_str(), 0644) < 0) {
+				fprintf(stderr, "Unable change file permission: [%s]. Reason: %s\n", std_file.c_str(), strerror(errno));
+				return -1;
+			}
+		}
 	}
 
-	int *lock_pfd = nullptr;
-	if (lock_fd != 0) {
-		lock_pfd = new int;
-		*lock_pfd = lock_fd;
+	return 0;
+}
+
+int reopen_logs() {
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	if (g_config == nullptr) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	if (config->operator[]("as_daemon").asBool()) {
-		pid_t p = daemonize::detached::make();
-		if (p != 0) {
-			return p; // -V::773
+	return redirect_stdio(*g_config, O_APPEND);
+}
+
+/**
+ * \brief   Create log directory if it does not exist
+ *
+ * \return 0 on success, -1 otherwise
+ */
+static int make_log_dir(const Json::Value &config) {
+	std::string log_dir(config["log"]["dir"].asString());
+	std::string log_path;
+
+	if (log_dir.substr(0, 1) == "/") {
+		log_path = log_dir;
+	} else {
+		log_path = config["env_dir"].asString();
+		if (log_path.back() != '/') {
+			log_path += "/";
 		}
+
+		log_path += log_dir;
 	}
 
-	g_lock_fd   = lock_pfd;
-	g_config    = config;
-	cleanup     = cb;
-	cleanup_ctx = userdata;
+	boost::system::error_code ec;
 
-	// Setup environment dir
-	if (chdir(config->operator[]("env_dir").asString().c_str()) < 0) {
-		std::cerr << "error set env dir: " << strerror(errno) << std::endl;
-		exit_daemon(EXIT_FAILURE);
+	if (!boost::filesystem::exists(log_path, ec)) {
+		boost::filesystem::create_directory(log_path, ec);
 	}
 
-	// check of log directory exists
-	std::string log_path(config->operator[]("env_dir").asString());
-	if (log_path.back() != '/') {
-		log_path += "/";
+	if (ec) {
+		fprintf(stderr, "Unable to create log dir: [%s]. Error: %s\n", log_path.c_str(), ec.message().c_str());
+		return -1;
 	}
 
-	if (config->operator[]("log")["dir"].asString().substr(0, 1) != "/") {
-		log_path += config->operator[]("log")["dir"].asString();
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int         resource;
+} rlimit_names[] = {
+	{"as",      RLIMIT_AS},
+	{"core",    RLIMIT_CORE},
+	{"cpu",     RLIMIT_CPU},
+	{"data",    RLIMIT_DATA},
+	{"fsize",   RLIMIT_FSIZE},
+	{"memlock", RLIMIT_MEMLOCK},
+	{"nofile",  RLIMIT_NOFILE},
+	{"nproc",   RLIMIT_NPROC},
+	{"stack",   RLIMIT_STACK},
+};
+
+static int rlimit_resource(const std::string &name) {
+	for (const auto &r : rlimit_names) {
+		if (name == r.name) {
+			return r.resource;
+		}
 	}
 
-	if (!boost::filesystem::exists(log_path)) {
-		boost::filesystem::create_directory(log_path);
+	return -1;
+}
+
+/* limits and nice value the process had before config touched them */
+static std::map<int, rlimit> g_startup_rlimits;
+static bool g_nice_saved = false;
+static int  g_startup_nice = 0;
+
+/**
+ * \brief   Check types of "rlimits" and "nice" so nothing is applied from malformed config
+ *
+ * \return 0 on success, -1 with errno set to EINVAL otherwise
+ */
+static int validate_limits(const Json::Value &config) {
+	const Json::Value &limits = config["rlimits"];
+
+	if (!limits.isNull() && !limits.isObject()) {
+		fprintf(stderr, "Section [rlimits] must be an object\n");
+		errno = EINVAL;
+		return -1;
 	}
 
-	std::string std_file;
-	Json::Value io_config;
+	for (const auto &name : limits.getMemberNames()) {
+		const Json::Value &value = limits[name];
 
-	if (config->operator[]("io_mode").asString() == std::string("io_daemon")) {
-		io_config = config->operator[]("io_daemon");
-	} else {
-		io_config = config->operator[]("io_debug");
+		if (rlimit_resource(name) < 0) {
+			fprintf(stderr, "Unknown rlimit: [%s]\n", name.c_str());
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (!value.isUInt64() && !(value.isString() && value.asString() == "unlimited")) {
+			fprintf(stderr, "Invalid value of rlimit [%s], expected number or \"unlimited\"\n", name.c_str());
+			errno = EINVAL;
+			return -1;
+		}
 	}
 
-	if (io_config["stdin"].asString() != std::string("stdin")) {
-		// stdin needs redirection
-		if (io_config["stdin"].asString().compare("/dev/null") == 0) {
-			std_file = "/dev/null";
-		} else {
-			std_file = config->operator[]("log")["dir"].asString();
-			std_file.append("/");
-			std_file.append(io_config["stdin"].asString());
+	const Json::Value &nice = config["nice"];
+
+	if (!nice.isNull() && (!nice.isInt() || nice.asInt() < -20 || nice.asInt() > 19)) {
+		fprintf(stderr, "Invalid nice value, expected integer in range [-20, 19]\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int set_rlimit(const std::string &name, int resource, const rlimit &rl) {
+	if (setrlimit(resource, &rl) < 0) {
+		fprintf(stderr, "Unable to set rlimit [%s]. Error: %s\n", name.c_str(), strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief   Apply members of "rlimits" section which differ from the previous one
+ *          Value is number or "unlimited" and sets soft limit, hard limit is raised when needed
+ *          Members removed since previous section get back limits the process started with
+ *          Section must pass validate_limits()
+ *
+ * \param[in]  limits
+ * \param[in]  prev    - previously applied section, null on startup
+ * \param[out] applied - running section, updated with every member applied, may be null
+ *
+ * \return 0 on success, -1 otherwise
+ */
+static int apply_rlimits(const Json::Value &limits, const Json::Value &prev, Json::Value *applied = nullptr) {
+	for (const auto &name : limits.getMemberNames()) {
+		const Json::Value &value = limits[name];
+
+		if (!prev.isNull() && prev[name] == value) {
+			continue;
 		}
 
-		close(STDIN_FILENO);
+		int resource = rlimit_resource(name);
 
-		int stdin_fd = open(std_file.c_str(), O_RDONLY);
+		rlim_t limit = value.isString() ? RLIM_INFINITY : static_cast<rlim_t>(value.asUInt64());
 
-		if (stdin_fd != 0) {
-			if (stdin_fd > 0)
-				close(stdin_fd);
-			fprintf(stderr, "Unable to redirect stdin: Opened to: %d. Error: %s", stdin_fd, strerror(errno));
-			exit_daemon(EXIT_FAILURE);
+		rlimit rl = {};
+		if (getrlimit(resource, &rl) < 0) {
+			return -1;
+		}
+
+		g_startup_rlimits.emplace(resource, rl);
+
+		rl.rlim_cur = limit;
+
+		if (rl.rlim_max != RLIM_INFINITY && (limit == RLIM_INFINITY || limit > rl.rlim_max)) {
+			rl.rlim_max = limit;
+		}
+
+		if (set_rlimit(name, resource, rl) < 0) {
+			return -1;
+		}
+
+		if (applied != nullptr) {
+			(*applied)[name] = value;
 		}
 	}
 
-	if (io_config["stdout"].asString() != std::string("stdout")) {
-		// stdout needs redirection
-		if (io_config["stdout"].asString().compare("/dev/null") == 0) {
-			std_file = "/dev/null";
+	for (const auto &name : prev.getMemberNames()) {
+		if (limits.isMember(name)) {
+			continue;
+		}
+
+		auto it = g_startup_rlimits.find(rlimit_resource(name));
+
+		/* hard limit is only ever raised by config, so lowering it back needs no privileges */
+		if (it != g_startup_rlimits.end() && set_rlimit(name, it->first, it->second) < 0) {
+			return -1;
+		}
+
+		if (applied != nullptr) {
+			applied->removeMember(name);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * \brief   Set nice value of every thread of the process, Linux keeps it per thread
+ *
+ * \return 0 on success, -1 otherwise
+ */
+static int apply_nice(int nice) {
+	if (!g_nice_saved) {
+		errno = 0;
+		int current = getpriority(PRIO_PROCESS, 0);
+
+		if (current == -1 && errno != 0) {
+			return -1;
+		}
+
+		g_startup_nice = current;
+		g_nice_saved   = true;
+	}
+
+	DIR *dir = opendir("/proc/self/task");
+	if (dir == nullptr) {
+		return setpriority(PRIO_PROCESS, 0, nice);
+	}
+
+	int rc = 0;
+	int err = 0;
+
+	while (dirent *ent = readdir(dir)) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+
+		if (setpriority(PRIO_PROCESS, static_cast<id_t>(atoi(ent->d_name)), nice) < 0 && errno != ESRCH) {
+			err = errno;
+			fprintf(stderr, "Unable to set nice value. Error: %s\n", strerror(err));
+			rc = -1;
+			break;
+		}
+	}
+
+	closedir(dir);
+
+	if (rc != 0) {
+		errno = err;
+	}
+
+	return rc;
+}
+
+static cgroup_limits read_cgroup_limits(const Json::Value &config) {
+	cgroup_limits limits;
+
+	limits.cpu_max     = config["cpu.max"].asString();
+	limits.cpu_weight  = config["cpu.weight"].asString();
+	limits.memory_high = config["memory.high"].asString();
+	limits.memory_max  = config["memory.max"].asString();
+	limits.io_weight   = config["io.weight"].asString();
+	limits.pids_max    = config["pids.max"].asString();
+
+	return limits;
+}
+
+/**
+ * \brief   Apply "cgroup" section. Daemon is moved only if group path differs from previous one
+ *
+ * \param[in]  config
+ * \param[in]  prev   - previously applied section, null on startup
+ *
+ * \return 0 on success, -1 otherwise
+ */
+static int setup_cgroup(const Json::Value &config, const Json::Value &prev) {
+	std::string path(config["path"].asString());
+	bool move = prev.isNull() || prev["path"] != config["path"];
+
+	if (move && cgroup::create(path) != 0) {
+		fprintf(stderr, "Unable to create cgroup \"%s\". Error: %s\n", path.c_str(), strerror(errno));
+		return -1;
+	}
+
+	if (cgroup::apply(path, read_cgroup_limits(config)) != 0) {
+		fprintf(stderr, "Unable to set cgroup \"%s\" limits. Error: %s\n", path.c_str(), strerror(errno));
+		return -1;
+	}
+
+	if (move && cgroup::attach(path, 0) != 0) {
+		fprintf(stderr, "Unable to move daemon into cgroup \"%s\". Error: %s\n", path.c_str(), strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static Json::Value io_section(const Json::Value &config) {
+	return config["io_mode"].asString() == std::string("io_daemon") ? config["io_daemon"] : config["io_debug"];
+}
+
+void set_config_loader(config_loader_cb cb, void *ctx) {
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	g_loader     = cb;
+	g_loader_ctx = ctx;
+}
+
+int reload(Json::Value *config) {
+	if (config == nullptr) {
+		config_loader_cb loader;
+		void *loader_ctx;
+
+		{
+			std::lock_guard<std::mutex> lock(g_mutex);
+
+			loader     = g_loader;
+			loader_ctx = g_loader_ctx;
+		}
+
+		if (loader == nullptr) {
+			errno = ENOSYS;
+			return -1;
+		}
+
+		config = loader(loader_ctx);
+		if (config == nullptr) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	if (g_config == nullptr) {
+		delete config;
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* read through const references only, non-const operator[] adds null members */
+	const Json::Value &prev = *g_config;
+	const Json::Value &next = *config;
+
+	/* startup only members stay as they are */
+	for (const char *key : {"env_dir", "as_daemon", "lock_file", "instance", "control"}) {
+		if (prev.isMember(key)) {
+			(*config)[key] = prev[key];
 		} else {
-			std_file = config->operator[]("log")["dir"].asString();
-			std_file.append("/");
-			std_file.append(io_config["stdout"].asString());
+			config->removeMember(key);
 		}
+	}
 
-		close(STDOUT_FILENO);
+	/* leaving a cgroup needs a place to move to, so section removal waits for restart */
+	if (prev.isMember("cgroup") && !next.isMember("cgroup")) {
+		(*config)["cgroup"] = prev["cgroup"];
+	}
 
-		int stdout_fd = open(std_file.c_str(), O_CREAT | O_WRONLY | O_TRUNC);
-		if (stdout_fd != 1) {
-			if (stdout_fd > 0)
-				close(stdout_fd);
-			fprintf(stderr, "Unable to redirect stdout to: %s. Error: %s\n", std_file.c_str(), strerror(errno));
-			exit_daemon(EXIT_FAILURE);
+	if (validate_limits(next) != 0) {
+		delete config;
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* sections are recorded as they get applied, so failed reload leaves config matching the process */
+	Json::Value applied(prev);
+	bool log_dir_changed = prev["log"]["dir"] != next["log"]["dir"];
+	int rc = 0;
+
+	if (log_dir_changed || io_section(prev) != io_section(next)) {
+		if (log_dir_changed) {
+			rc = make_log_dir(next);
 		}
 
-		if (std_file.compare("/dev/null") != 0) {
-			if (chmod(std_file.c_str(), 0644) < 0) {
-				fprintf(stderr, "Unable change file permission: [%s]. Reason: %s\n", std_file.c_str(), strerror(errno));
-				exit_daemon(EXIT_FAILURE);
+		if (rc == 0) {
+			rc = redirect_stdio(next, O_APPEND);
+		}
+
+		if (rc == 0) {
+			for (const char *key : {"log", "io_mode", "io_daemon", "io_debug"}) {
+				applied[key] = next[key];
 			}
 		}
 	}
 
-	if (io_config["stderr"].asString() != std::string("stderr")) {
-		// stderr needs redirection
-		if (io_config["stderr"].asString().compare("/dev/null") == 0) {
-			std_file = "/dev/null";
+	if (rc == 0 && prev["rlimits"] != next["rlimits"]) {
+		rc = apply_rlimits(next["rlimits"], prev["rlimits"], &applied["rlimits"]);
+	}
+
+	if (rc == 0 && prev["nice"] != next["nice"]) {
+		if (next.isMember("nice")) {
+			rc = apply_nice(next["nice"].asInt());
+
+			if (rc == 0) {
+				applied["nice"] = next["nice"];
+			}
+		} else if (!g_nice_saved) {
+			applied.removeMember("nice");
+		} else if (apply_nice(g_startup_nice) == 0) {
+			applied.removeMember("nice");
+		} else if (errno == EACCES || errno == EPERM) {
+			/* lowering nice back needs CAP_SYS_NICE, keep the current one */
+			fprintf(stderr, "Keeping nice value %d, restoring %d is not permitted\n", prev["nice"].asInt(), g_startup_nice);
+			(*config)["nice"] = prev["nice"];
 		} else {
-			std_file = config->operator[]("log")["dir"].asString();
-			std_file.append("/");
-			std_file.append(io_config["stderr"].asString());
+			rc = -1;
+		}
+	}
+
+	if (rc == 0 && prev["cgroup"] != next["cgroup"] && next.isMember("cgroup")) {
+		rc = setup_cgroup(next["cgroup"], prev["cgroup"]);
+
+		if (rc == 0) {
+			applied["cgroup"] = next["cgroup"];
+		}
+	}
+
+	if (rc == 0 && prev["pid_file"] != next["pid_file"]) {
+		if (!next["pid_file"].empty()) {
+			rc = write_pid(next["pid_file"].asString());
+		}
+
+		if (rc == 0 && !prev["pid_file"].empty()) {
+			unlink(prev["pid_file"].asString().c_str());
+		}
+	}
+
+	if (rc != 0) {
+		int err = errno;
+
+		if (applied["rlimits"].isNull() || applied["rlimits"].empty()) {
+			applied.removeMember("rlimits");
+		}
+
+		*g_config = applied;
+		delete config;
+		errno = err;
+		return -1;
+	}
+
+	delete g_config;
+	g_config = config;
+
+	return 0;
+}
+
+pid_t make_daemon(Json::Value *config, cleanup_cb cb, void *userdata) {
+	control::phase("start");
+
+	verify_config(config);
+
+	if (validate_limits(*config) != 0) {
+		exit_daemon(EXIT_FAILURE);
+	}
+
+	int lock_fd = 0;
+	if (config->isMember("lock_file")) {
+		lock_fd = already_running(config->operator[]("lock_file").asString());
+		control::phase("lock");
+	}
+
+	int *lock_pfd = nullptr;
+	if (lock_fd != 0) {
+		lock_pfd = new int;
+		*lock_pfd = lock_fd;
+	}
+
+	if (config->operator[]("as_daemon").asBool()) {
+		pid_t p = daemonize::detached::make();
+		if (p != 0) {
+			return p; // -V::773
 		}
 
-		close(STDERR_FILENO);
+		control::phase("detach");
+	}
 
-		int stderr_fd = open(std_file.c_str(), O_CREAT | O_WRONLY | O_TRUNC);
+	g_lock_fd   = lock_pfd;
+	g_config    = config;
+	cleanup     = cb;
+	cleanup_ctx = userdata;
 
-		if (stderr_fd != 2) {
-			if (stderr_fd > 0)
-				close(stderr_fd);
-			fprintf(stderr, "Unable to redirect stderr to: %s. Error: %s", std_file.c_str(), strerror(errno));
+	if (config->isMember("cgroup")) {
+		if (setup_cgroup(config->operator[]("cgroup"), Json::Value()) != 0) {
 			exit_daemon(EXIT_FAILURE);
 		}
 
-		if (std_file.compare("/dev/null") != 0) {
-			if (chmod(std_file.c_str(), 0644) < 0) {
-				fprintf(stderr, "Unable change file permission: [%s]. Reason: %s", std_file.c_str(), strerror(errno));
-				exit_daemon(EXIT_FAILURE);
+		control::phase("cgroup");
+	}
+
+	// Setup environment dir
+	if (chdir(config->operator[]("env_dir").asString().c_str()) < 0) {
+		std::cerr << "error set env dir: " << strerror(errno) << std::endl;
+		exit_daemon(EXIT_FAILURE);
+	}
+
+	if (config->isMember("instance")) {
+		const Json::Value &inst = config->operator[]("instance");
+		std::string dir(instance_dir(*config));
+
+		g_instance_fd = instance::claim(dir, inst["name"].asString(), inst["index"].asUInt());
+
+		if (g_instance_fd < 0) {
+			if (errno == EAGAIN) {
+				fprintf(stderr, "Instance %s.%u is already running\n", inst["name"].asString().c_str(), inst["index"].asUInt());
+			} else {
+				fprintf(stderr, "Unable to claim instance %s.%u in [%s]. Error: %s\n",
+				        inst["name"].asString().c_str(), inst["index"].asUInt(), dir.c_str(), strerror(errno));
 			}
+			exit_daemon(EXIT_FAILURE);
 		}
+
+		control::phase("instance");
 	}
 
+	// check of log directory exists
+	if (make_log_dir(*config) != 0) {
+		exit_daemon(EXIT_FAILURE);
+	}
+
+	control::phase("env");
+
+	if (redirect_stdio(*config, O_TRUNC) != 0) {
+		exit_daemon(EXIT_FAILURE);
+	}
+
+	control::phase("stdio");
+
 	rlimit core_limits = {};
 	core_limits.rlim_cur = core_limits.rlim_max = (rlim_t)RLIM_INFINITY;
 
@@ -244,8 +723,37 @@ pid_t make_daemon(Json::Value *config, cleanup_cb cb, void *userdata) {
 		exit_daemon(EXIT_FAILURE);
 	}
 
+	if (config->isMember("rlimits") && apply_rlimits(config->operator[]("rlimits"), Json::Value()) != 0) {
+		exit_daemon(EXIT_FAILURE);
+	}
+
+	if (config->isMember("nice") && apply_nice(config->operator[]("nice").asInt()) != 0) {
+		exit_daemon(EXIT_FAILURE);
+	}
+
+	control::phase("limits");
+
 	if (!g_config->operator[]("pid_file").empty()) {
-		write_pid(config->operator[]("pid_file").asString());
+		if (write_pid(config->operator[]("pid_file").asString()) != 0) {
+			exit_daemon(EXIT_FAILURE);
+		}
+	}
+
+	control::phase("pid_file");
+
+	if (config->isMember("control")) {
+		std::string socket_path(config->operator[]("control")["socket"].asString());
+
+		if (socket_path.substr(0, 1) != "/") {
+			socket_path = config->operator[]("env_dir").asString() + "/" + socket_path;
+		}
+
+		if (control::start(socket_path) != 0) {
+			fprintf(stderr, "Unable to open control socket: [%s]. Error: %s\n", socket_path.c_str(), strerror(errno));
+			exit_daemon(EXIT_FAILURE);
+		}
+
+		control::phase("control");
 	}
 
 	return 0;
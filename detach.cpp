@@ -18,9 +18,11 @@
  */
 
 #include <sys/wait.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <daemon/daemonize.hpp>
+#include <daemon/accounting.hpp>
 #include <daemon/utils.hpp>
 
 namespace daemonize {
@@ -28,6 +30,9 @@ namespace daemonize {
 pid_t detached::execute(const char *path, const char *const argv[], const char *const envv[]) {
 	pid_t pid = make();
 
+	if (pid > 0)
+		accounting::track(pid, path, true);
+
 	if (pid > 0 || pid < 0)
 		return pid;
 
@@ -46,8 +51,8 @@ pid_t detached::make() {
 	pid_t pid;
 	int fds[2];
 
-	/* create pipe to retrieve pid of daemon */
-	if (pipe(fds) != 0) {
+	/* create pipe to retrieve pid of daemon, not to be leaked into concurrent spawns */
+	if (pipe2(fds, O_CLOEXEC) != 0) {
 		return -1;
 	}
 
@@ -62,19 +67,25 @@ pid_t detached::make() {
 		}
 
 		int status;
+		pid_t ret;
 
 		/* wait until child process finish with daemon startup */
-		while (-1 == waitpid(pid, &status, 0)) {
+		while (-1 == (ret = waitpid(pid, &status, 0))) {
 			/* ignore POSIX signals */
 			if (EINTR != errno) {
-				pid = -1;
-
-				goto done;
+				break;
 			}
 		}
 
+		/* ECHILD: reaped by concurrent wait(-1), pipe alone tells whether daemon started */
+		if (-1 == ret && ECHILD != errno) {
+			pid = -1;
+
+			goto done;
+		}
+
 		/* daemon startup failed */
-		if (EXIT_FAILURE == WEXITSTATUS(status)) {
+		if (-1 != ret && EXIT_FAILURE == WEXITSTATUS(status)) {
 			pid = -1;
 
 			goto done;
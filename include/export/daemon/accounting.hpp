@@ -0,0 +1,150 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+namespace daemonize {
+
+/**
+ * \brief   Point of child's resource timeline
+ */
+struct usage_sample {
+	uint64_t at_us;  ///< since start of the child
+	uint64_t rss;    ///< bytes
+	uint64_t cpu_us; ///< user + system
+};
+
+/**
+ * \brief   Resources consumed by a finished child
+ *          Children started by \ref detached::execute() are not ours to wait for: they are
+ *          finalized by \ref accounting::sample() once gone and carry sampled values only
+ */
+struct exit_record {
+	pid_t       pid    = 0;
+	std::string path;
+	int         status = 0;     ///< as from waitpid(), valid if reaped
+	bool        reaped = false; ///< rusage fields are valid
+
+	uint64_t started_us  = 0; ///< wall clock, since epoch
+	uint64_t lifetime_us = 0;
+
+	uint64_t user_us = 0;
+	uint64_t sys_us  = 0;
+	uint64_t max_rss = 0; ///< bytes
+	uint64_t minflt  = 0;
+	uint64_t majflt  = 0;
+	uint64_t nvcsw   = 0;
+	uint64_t nivcsw  = 0;
+	uint64_t inblock = 0;
+	uint64_t oublock = 0;
+
+	std::vector<usage_sample> timeline;
+};
+
+/**
+ * \brief   Per-child resource accounting
+ *          Disabled by default. Once enabled, children spawned with \ref child::execute() and
+ *          \ref detached::execute() are tracked until reaped with \ref wait().
+ *          \ref wait() must be the only reaper of tracked children: child reaped with plain
+ *          waitpid() loses it's rusage and stays in live set until \ref sample() notices it's gone.
+ *          Live set is capped, children spawned beyond the cap are counted as untracked.
+ *          Children which are not tracked are reaped by \ref wait() without a record.
+ *          Finished children are kept in a bounded table, oldest records are evicted first
+ */
+class accounting {
+public:
+	enum class order {
+		cpu,
+		rss,
+		lifetime,
+		io,
+	};
+
+public:
+	/**
+	 * \param[in]  max_records - size of exit records table, 0 disables accounting
+	 * \param[in]  max_samples - timeline points kept per child, newest win
+	 * \param[in]  max_live    - cap of simultaneously tracked children
+	 */
+	static void enable(size_t max_records, size_t max_samples = 64, size_t max_live = 65536);
+
+	/**
+	 * \brief   Start tracking of a child. Called by execute() functions right after fork(),
+	 *          before the child can be reaped
+	 */
+	static void track(pid_t pid, const char *path, bool detached = false);
+
+	/**
+	 * \brief   Forget child which failed to exec. Called by execute() functions
+	 */
+	static void untrack(pid_t pid);
+
+	/**
+	 * \brief   waitpid() replacement recording rusage of reaped child
+	 *
+	 * \param[in]   pid
+	 * \param[out]  status
+	 * \param[in]   options
+	 * \param[out]  rec     - optional copy of the record, it has no path and start time
+	 *                        if reaped child was not tracked
+	 *
+	 * \return as waitpid(). With pid -1 any child is reaped, including ones not spawned
+	 *         by the library
+	 */
+	static pid_t wait(pid_t pid, int *status, int options, exit_record *rec = nullptr);
+
+	/**
+	 * \brief   Append RSS and CPU time of each live tracked child to it's timeline.
+	 *          Meant to be called periodically, costs one read of /proc/<pid>/stat per child
+	 *
+	 * \return number of live tracked children
+	 */
+	static size_t sample();
+
+	/**
+	 * \return copy of exit records, oldest first
+	 */
+	static std::vector<exit_record> records();
+
+	/**
+	 * \return up to n records with highest consumption by key
+	 */
+	static std::vector<exit_record> top(order key, size_t n);
+
+	/**
+	 * \brief   Export records and per executable totals
+	 *
+	 * \param[in]  top_n - export only n records with highest CPU time, 0 - all records
+	 *
+	 * \return  {"live": N, "untracked": N, "records": [...], "by_path": {"/bin/x": {"count": .., "user_us": .., ...}}}
+	 */
+	static Json::Value dump(size_t top_n = 0);
+
+	static void clear();
+};
+
+} // namespace daemonize
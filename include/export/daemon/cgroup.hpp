@@ -0,0 +1,124 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+
+namespace daemonize {
+
+/**
+ * \brief   cgroup v2 resource knobs. Values are written as is, empty value leaves knob untouched
+ */
+struct cgroup_limits {
+	std::string cpu_max;     ///< "$MAX $PERIOD", e.g. "50000 100000", or "max"
+	std::string cpu_weight;  ///< 1..10000
+	std::string memory_high; ///< bytes (K/M/G suffixes allowed) or "max"
+	std::string memory_max;  ///< bytes (K/M/G suffixes allowed) or "max"
+	std::string io_weight;   ///< 1..10000, or "default N"
+	std::string pids_max;    ///< number or "max"
+};
+
+/**
+ * \brief   One line of cgroup pressure file (PSI)
+ */
+struct cgroup_pressure {
+	double   avg10  = 0;
+	double   avg60  = 0;
+	double   avg300 = 0;
+	uint64_t total  = 0; ///< usec
+};
+
+/**
+ * \brief   Usage and pressure of the group. Counters of disabled controllers stay zero
+ */
+struct cgroup_stats {
+	uint64_t cpu_usage_usec  = 0;
+	uint64_t cpu_user_usec   = 0;
+	uint64_t cpu_system_usec = 0;
+	uint64_t nr_throttled    = 0;
+	uint64_t throttled_usec  = 0;
+	uint64_t memory_current  = 0;
+	uint64_t memory_peak     = 0; ///< kernel 5.19+
+	uint64_t pids_current    = 0;
+
+	cgroup_pressure cpu_some;
+	cgroup_pressure cpu_full;
+	cgroup_pressure memory_some;
+	cgroup_pressure memory_full;
+	cgroup_pressure io_some;
+	cgroup_pressure io_full;
+};
+
+/**
+ * \brief   cgroup v2 helpers
+ *          Path arguments are resolved by \ref resolve(), so relative paths work
+ *          inside of a delegated subtree without root privileges.
+ *          All functions return 0 on success, -1 otherwise and errno is set
+ */
+class cgroup {
+public:
+	/**
+	 * \brief   Resolve group path to absolute directory
+	 *          paths under cgroup2 mount point are used as is, other absolute paths are relative to the mount,
+	 *          relative paths are relative to cgroup the calling process was in at the first call
+	 *
+	 * \param[in]   path
+	 * \param[out]  abs
+	 */
+	static int resolve(const std::string &path, std::string *abs);
+
+	/**
+	 * \brief   Create group (including missing parents). Existing group is not an error
+	 *          Available cpu, memory, io and pids controllers are enabled only in groups created here
+	 *          and in the deepest existing ancestor if it lies within our own (delegated) group.
+	 *          When that ancestor is our own group, calling process is moved into it's "self" leaf first,
+	 *          as group with processes can't pass controllers to children
+	 */
+	static int create(const std::string &path);
+
+	/**
+	 * \brief   Open group directory
+	 *
+	 * \return  descriptor (O_CLOEXEC) suitable for \ref spawn_opts::cgroup_fd, -1 on error
+	 */
+	static int open(const std::string &path);
+
+	/**
+	 * \brief   Write limits into the group
+	 */
+	static int apply(const std::string &path, const cgroup_limits &limits);
+
+	/**
+	 * \brief   Move process into the group
+	 *
+	 * \param[in]  pid - 0 for calling process
+	 */
+	static int attach(const std::string &path, pid_t pid);
+
+	/**
+	 * \brief   Read usage and pressure of the group
+	 */
+	static int stats(const std::string &path, cgroup_stats *st);
+};
+
+} // namespace daemonize
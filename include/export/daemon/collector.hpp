@@ -0,0 +1,151 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace daemonize {
+
+/**
+ * \brief   Capture options of a stream registered in \ref collector
+ */
+struct capture_opts {
+	size_t      max_bytes = 64 * 1024; ///< buffered output cap per job
+	bool        lines     = true;      ///< buffer whole lines only
+	std::string prefix;                ///< prepended to each line, lines mode only
+};
+
+/**
+ * \brief   Output of a job taken from \ref collector
+ */
+struct capture_output {
+	std::string data;
+	size_t      dropped = 0;     ///< bytes discarded due to the cap
+	bool        eof     = false; ///< all streams of the job are closed
+};
+
+/**
+ * \brief   Collects output of many children into per-job buffers
+ *          One epoll instance serves all of registered descriptors, no threads involved:
+ *          caller drives it with \ref poll() or polls \ref fd() from own event loop.
+ *          Memory used by a job never exceeds \ref capture_opts::max_bytes of buffered data
+ *          plus one partial line per stream, excess output is counted and dropped.
+ *          In lines mode complete lines are kept whole or dropped whole, while an unterminated
+ *          line reaching the cap (or left at eof) is cut to the room left and terminated with '\n',
+ *          the rest of it up to the next newline is dropped
+ */
+class collector {
+public:
+	typedef uint64_t job_id;
+
+	collector();
+	~collector();
+
+	collector(const collector &) = delete;
+	collector &operator=(const collector &) = delete;
+
+	/**
+	 * \brief   Register stream of the job. Several streams (e.g. stdout and stderr) may share one job
+	 *
+	 * \param[in]  job
+	 * \param[in]  fd   - read end of pipe, collector takes ownership of it
+	 * \param[in]  opts
+	 *
+	 * \return 0 on success, -1 otherwise and errno is set. fd is closed in both cases
+	 */
+	int add(job_id job, int fd, const capture_opts &opts = capture_opts());
+
+	/**
+	 * \brief   Wait for output and dispatch it into job buffers
+	 *
+	 * \param[in]  timeout_ms - as for epoll_wait()
+	 *
+	 * \return number of handled events, -1 on error
+	 */
+	int poll(int timeout_ms);
+
+	/**
+	 * \brief   Move buffered output of the job out. Job is forgotten once it's output reported eof
+	 *
+	 * \return false if job is unknown
+	 */
+	bool take(job_id job, capture_output *out);
+
+	/**
+	 * \brief   Close all streams of the job and drop it's output
+	 */
+	void remove(job_id job);
+
+	size_t jobs() const {
+		return jobs_.size();
+	}
+
+	/**
+	 * \return epoll descriptor, readable when \ref poll() has work to do
+	 */
+	int fd() const {
+		return epfd_;
+	}
+
+private:
+	struct stream {
+		job_id      job;
+		bool        lines;
+		std::string prefix;
+		std::string partial;
+		bool        discard = false; ///< skipping the rest of a cut line
+	};
+
+	struct job {
+		capture_output   out;
+		size_t           max_bytes;
+		std::vector<int> fds;
+	};
+
+private:
+	void consume(stream &s, job &j, const char *data, size_t len);
+	void append(const stream &s, job &j, const char *data, size_t len);
+	void flush_partial(stream &s, job &j);
+	void close_stream(int fd);
+
+private:
+	int                                epfd_;
+	std::vector<char>                  buf_;
+	std::unordered_map<int, stream>    streams_;
+	std::unordered_map<job_id, job>    jobs_;
+};
+
+/**
+ * \brief   Read contents of memfd captured with \ref stdio_mode::memfd
+ *
+ * \param[in]   fd
+ * \param[out]  out
+ * \param[in]   max_bytes - read no more than this
+ *
+ * \return full size of captured output, -1 on error
+ */
+ssize_t read_memfd(int fd, std::string *out, size_t max_bytes);
+
+} // namespace daemonize
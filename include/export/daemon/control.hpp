@@ -0,0 +1,92 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <json/json.h>
+
+namespace daemonize {
+
+/**
+ * \typedef
+ *
+ * \brief   Control command handler
+ *
+ * \param[in]   request - parsed request, always has "cmd" member
+ * \param[out]  reply   - members to add to reply object
+ * \param[in]   ctx     - user data given to \ref control::handle()
+ *
+ * \return 0 on success, otherwise reply reports failure
+ */
+typedef int (*control_cb)(const Json::Value &request, Json::Value *reply, void *ctx);
+
+/**
+ * \brief   Unix-domain control socket of the daemon
+ *          All of connections are served by a single thread with epoll and non-blocking I/O.
+ *          Protocol is newline delimited: request is either a bare command name
+ *          (e.g. "status") or JSON object {"cmd": "status", ...}, reply is one line of JSON
+ *          with "ok" member and "error" member on failure.
+ *
+ *          Built-in commands:
+ *            - status       - pid, uptime, startup phases, fd and child counts, memory usage
+ *            - reopen-logs  - \ref reopen_logs()
+ *            - reload       - \ref reload() with config from loader, SIGHUP to the process if there is no loader
+ *            - graceful-stop - sends SIGTERM to the process unless handler is registered
+ *            - accounting   - \ref accounting::dump() of "top" (default 10) records
+ */
+class control {
+public:
+	/**
+	 * \brief   Create socket and start serving thread
+	 *          Thread blocks all signals, so it does not interfere with signal handling of the application
+	 *
+	 * \param[in]  path - socket path. Socket file nobody listens on is replaced, socket is
+	 *                    accessible by the owner only (0600)
+	 *
+	 * \return 0 on success, -1 otherwise and errno is set, EADDRINUSE if another process
+	 *         serves the path or it is not a socket
+	 */
+	static int start(const std::string &path);
+
+	/**
+	 * \brief   Stop serving thread and remove socket file
+	 */
+	static void stop();
+
+	/**
+	 * \brief   Register handler for command. Overrides built-in one with same name
+	 *
+	 * \param[in]  cmd
+	 * \param[in]  cb   - nullptr removes handler
+	 * \param[in]  ctx
+	 */
+	static void handle(const std::string &cmd, control_cb cb, void *ctx = nullptr);
+
+	/**
+	 * \brief   Record end of startup phase. Reported by status command in microseconds
+	 *          since the first recorded phase
+	 *
+	 * \param[in]  name
+	 */
+	static void phase(const char *name);
+};
+
+} // namespace daemonize
@@ -30,6 +30,15 @@ namespace daemonize {
  */
 typedef void (*cleanup_cb)(void *ctx);
 
+/**
+ * \typedef
+ *
+ * \brief   Provides fresh config for \ref reload()
+ *
+ * \return new config allocated with new, ownership passes to the library. nullptr on error
+ */
+typedef Json::Value *(*config_loader_cb)(void *ctx);
+
 /**
  * \brief   Daemonize application
  *          This function may call \ref exit() in case of fatal error
@@ -40,9 +49,31 @@ typedef void (*cleanup_cb)(void *ctx);
  *                         {
  *                             "as_daemon" : true,
  *                             "env_dir" : "/dir/dir",
- *                             "lock_file" : , // usually path to executable
+ *                             "lock_file" : , // usually path to executable, allows single instance per binary
+ *                             "instance" : { // optional, named instance, see daemonize::instance
+ *                                 "name" : "service",
+ *                                 "index" : 0,
+ *                                 "dir" : "/var/run/service" // lock and pid files location, default env_dir
+ *                             },
  *                             "pid_file" : "/var/run/service.pid,
+ *                             "control" : { // optional
+ *                                 "socket" : "control.sock" // relative to env_dir
+ *                             },
+ *                             "rlimits" : { // optional, number or "unlimited"
+ *                                 "nofile" : 65536,
+ *                                 "core" : "unlimited"
+ *                             },
+ *                             "nice" : 0, // optional
  *                             "io_mode" : "io_daemon",
+ *                             "cgroup" : { // optional, cgroup v2 group to move daemon into
+ *                                 "path" : "daemon", // relative to our own group or absolute
+ *                                 "cpu.max" : "50000 100000",
+ *                                 "cpu.weight" : 100,
+ *                                 "memory.high" : "1G",
+ *                                 "memory.max" : "2G",
+ *                                 "io.weight" : 100,
+ *                                 "pids.max" : 1024
+ *                             },
  *                             "io_daemon" : {
  *                                 "stdin": "/dev/null",
  *                                 "stdout": "/dev/null",
@@ -59,6 +90,41 @@ typedef void (*cleanup_cb)(void *ctx);
  */
 pid_t make_daemon(Json::Value *config, cleanup_cb cb = nullptr, void *userdata = nullptr);
 
+/**
+ * \brief   Apply new config to running daemon
+ *          Config is compared to the running one and only changed parts are re-applied:
+ *          log dir, stdio targets, rlimits, nice value, cgroup and pid file.
+ *          env_dir, as_daemon, lock_file, instance and control are taken at startup only and kept as is.
+ *          rlimits entries or nice value removed from config get back values process started with.
+ *          Unprivileged process can not lower nice value back, then current one is kept in running config.
+ *          Removal of cgroup section takes effect after restart only, so running section is kept.
+ *          Meant to be called from application's signal handling thread (e.g. on SIGHUP),
+ *          reload command of control socket calls it too
+ *
+ * \param[in]  config - new config, ownership passes to the library. nullptr to obtain it
+ *                      from loader set by \ref set_config_loader()
+ *
+ * \return 0 on success. -1 otherwise, errno is set (ENOSYS if there is no config and no loader,
+ *         EINVAL if rlimits or nice are malformed, nothing is applied then). Sections applied before
+ *         the failure stay applied and are recorded in running config, the rest of it stays as it was
+ */
+int reload(Json::Value *config = nullptr);
+
+/**
+ * \brief   Set config source for \ref reload()
+ *
+ * \param[in]  cb  - nullptr to reset
+ * \param[in]  ctx - user data passed to loader
+ */
+void set_config_loader(config_loader_cb cb, void *ctx = nullptr);
+
+/**
+ * \brief   Reopen redirected stdout/stderr (e.g. after log rotation), appending to target files
+ *
+ * \return 0 on success, -1 otherwise
+ */
+int reopen_logs();
+
 /**
  * \brief
  *
@@ -70,7 +136,8 @@ __attribute__ ((noreturn))
 void exit_daemon(int err);
 
 /**
- * \brief
+ * \brief   Spawn process detached from us (double fork + setsid)
+ *          Same thread safety guarantees as \ref child
  */
 class detached {
 public:
@@ -89,21 +156,58 @@ public:
 	static pid_t make();
 };
 
+/**
+ * \brief   Target of child's stdout/stderr
+ */
+enum class stdio_mode {
+	inherit, ///< share descriptor with the parent (default)
+	null,    ///< redirect to /dev/null
+	pipe,    ///< pipe, parent gets the read end. Suitable for \ref collector
+	memfd,   ///< anonymous memory file, parent reads it after child exits. Suitable for bulk output
+};
+
+/**
+ * \brief   Spawn options for \ref child::execute()
+ */
+struct spawn_opts {
+	stdio_mode out = stdio_mode::inherit;
+	stdio_mode err = stdio_mode::inherit;
+
+	/**
+	 * cgroup v2 directory descriptor (see \ref cgroup::open()) to start child in, -1 to stay in ours
+	 */
+	int cgroup_fd = -1;
+
+	/**
+	 * Filled on return with parent side descriptors (-1 if stream is not captured).
+	 * Descriptors are opened with O_CLOEXEC and owned by caller
+	 */
+	int out_fd = -1;
+	int err_fd = -1;
+};
+
+/**
+ * \brief   Spawn child process
+ *          Safe to call from many threads at once: descriptors created by the library are O_CLOEXEC,
+ *          child runs only async-signal-safe code until exec, and no lock is held across fork.
+ *          Descriptors opened by application without O_CLOEXEC are closed in the child as well
+ */
 class child {
 public:
 	/**
 	 * \brief
 	 *
-	 * \param[in]  path
-	 * \param[in]  argv
-	 * \param[in]  envv
+	 * \param[in]     path
+	 * \param[in]     argv
+	 * \param[in]     envv
+	 * \param[in,out] opts - optional spawn options
 	 *
-	 * \return
+	 * \return pid of the child, -1 if child could not be started or exec failed, errno is set
 	 */
-	static pid_t execute(const char *path, const char *const argv[], const char *const envv[] = nullptr);
+	static pid_t execute(const char *path, const char *const argv[], const char *const envv[] = nullptr, spawn_opts *opts = nullptr);
 
 private:
-	static pid_t make();
+	static pid_t make(spawn_opts *opts, int status_fd);
 };
 
 } // namespace daemonize
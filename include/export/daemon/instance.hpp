@@ -0,0 +1,132 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace daemonize {
+
+/**
+ * \brief   Binary record kept in instance lock file
+ */
+struct instance_record {
+	uint32_t magic;
+	uint32_t index;
+	int32_t  pid;
+	uint32_t reserved;
+	uint64_t start_token; ///< start time of the process in clock ticks since boot, defeats pid reuse
+};
+
+/**
+ * \brief   Named instances of a service, several per binary
+ *          Instance K of service "name" owns two files in the run directory:
+ *            - name.K.lock - holds open file description (OFD) write lock of running instance and
+ *                            \ref instance_record. Kernel drops the lock when the instance dies,
+ *                            so liveness is known without trusting pid files. The file is never removed
+ *            - name.K.pid  - pid as text, replaced atomically (temp file, fsync, rename)
+ */
+class instance {
+public:
+	/**
+	 * \brief   Claim instance slot: take lock and publish pid
+	 *          Lock belongs to the returned descriptor only, closing other descriptors of the lock file
+	 *          does not drop it. Children forked without exec share the descriptor and keep the lock
+	 *          until they close it, so call it from the process which is going to run.
+	 *          Second claim of the same slot fails even within one process
+	 *
+	 * \param[in]  dir
+	 * \param[in]  name
+	 * \param[in]  index
+	 *
+	 * \return lock descriptor (O_CLOEXEC) to keep open while running, -1 otherwise and errno is set,
+	 *         EAGAIN if instance is already running
+	 */
+	static int claim(const std::string &dir, const std::string &name, unsigned index);
+
+	/**
+	 * \brief   Remove pid file and drop the lock taken by \ref claim()
+	 */
+	static void release(const std::string &dir, const std::string &name, unsigned index, int lock_fd);
+
+	/**
+	 * \return start token of the process, 0 if unknown
+	 */
+	static uint64_t start_token(pid_t pid);
+
+	static std::string lock_path(const std::string &dir, const std::string &name, unsigned index);
+
+	static std::string pid_path(const std::string &dir, const std::string &name, unsigned index);
+};
+
+/**
+ * \brief   Prober of instances 0..count-1 of a service
+ *          Keeps lock files open, so checking an instance costs one fcntl() and one pread() of the record,
+ *          /proc is consulted only for a record not seen before.
+ *          Not thread safe, use one set per thread. Instances claimed by the calling process itself
+ *          are reported as running and probing them never affects the lock
+ */
+class instance_set {
+public:
+	instance_set(const std::string &dir, const std::string &name, unsigned count);
+	~instance_set();
+
+	instance_set(const instance_set &) = delete;
+	instance_set &operator=(const instance_set &) = delete;
+
+	/**
+	 * \return pid of running instance, 0 if not running, -1 on error,
+	 *         errno is EAGAIN if instance is being claimed and has not published its record yet
+	 */
+	pid_t alive(unsigned index);
+
+	/**
+	 * \brief   Open pidfd of running instance
+	 *          Record is always checked against /proc here, so pidfd never refers to a stale holder
+	 *
+	 * \return pidfd (O_CLOEXEC) owned by caller, -1 otherwise and errno is set, ESRCH if not running
+	 */
+	int pidfd(unsigned index);
+
+	/**
+	 * \brief   Read record of running instance
+	 *
+	 * \return 0 on success, -1 otherwise and errno is set, ESRCH if not running
+	 */
+	int record(unsigned index, instance_record *rec);
+
+	unsigned size() const {
+		return static_cast<unsigned>(fds_.size());
+	}
+
+private:
+	pid_t holder(unsigned index, instance_record *rec, bool verify = false);
+
+private:
+	std::string           dir_;
+	std::string           name_;
+	std::vector<int>      fds_;
+	std::vector<uint64_t> tokens_; ///< start token of the record verified for descriptor
+};
+
+} // namespace daemonize
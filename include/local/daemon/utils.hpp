@@ -3,8 +3,38 @@
 //
 #pragma once
 
+#include <sys/types.h>
+
+#include <string>
+
 namespace daemonize {
 
-int close_derived_fds();
+/**
+ * \brief   Close all descriptors above stderr
+ *          Uses only async-signal-safe calls, so may be called between fork and exec
+ *          of multithreaded process
+ *
+ * \param[in]  keep_fd - descriptor to leave open, -1 for none
+ *
+ * \return 0 on success, -1 otherwise
+ */
+int close_derived_fds(int keep_fd = -1);
+
+/**
+ * \brief   fork() straight into cgroup given by directory descriptor
+ *          Uses clone3(CLONE_INTO_CGROUP) when available, otherwise child migrates itself
+ *          right after fork, before anything else runs in it
+ *
+ * \return as fork()
+ */
+pid_t fork_into_cgroup(int cgroup_fd);
+
+/**
+ * \brief   Replace file contents atomically: write temporary file, fsync, rename over the target
+ *          and fsync directory. Readers see either old or new contents, never partial
+ *
+ * \return 0 on success, -1 otherwise and errno is set
+ */
+int write_file_atomic(const std::string &path, const void *data, size_t size, mode_t mode = 0644);
 
 } // namespace daemonize
@@ -0,0 +1,264 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <daemon/instance.hpp>
+#include <daemon/utils.hpp>
+
+namespace daemonize {
+
+static const uint32_t record_magic = 0x64736e69; // "insd"
+
+/* open file description locks: not dropped by closing other descriptors of the file, conflict within process too */
+static int lock_op(int fd, int cmd, struct flock *fl) {
+	fl->l_whence = SEEK_SET;
+	fl->l_start  = 0;
+	fl->l_len    = 0;
+	fl->l_pid    = 0;
+
+	int rc;
+	while ((rc = fcntl(fd, cmd, fl)) < 0 && errno == EINTR) {
+	}
+
+	return rc;
+}
+
+std::string instance::lock_path(const std::string &dir, const std::string &name, unsigned index) {
+	return dir + "/" + name + "." + std::to_string(index) + ".lock";
+}
+
+std::string instance::pid_path(const std::string &dir, const std::string &name, unsigned index) {
+	return dir + "/" + name + "." + std::to_string(index) + ".pid";
+}
+
+uint64_t instance::start_token(pid_t pid) {
+	char path[32];
+	char buf[1024];
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+
+	ssize_t rd = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if (rd <= 0) {
+		return 0;
+	}
+
+	buf[rd] = '\0';
+
+	/* starttime is 22nd field, comm may contain anything, so count after the last ')' */
+	const char *p = strrchr(buf, ')');
+	unsigned long long token = 0;
+
+	if (p == nullptr || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &token) != 1) {
+		return 0;
+	}
+
+	return token;
+}
+
+int instance::claim(const std::string &dir, const std::string &name, unsigned index) {
+	int fd = open(lock_path(dir, name, index).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+
+	struct flock fl = {};
+	fl.l_type = F_WRLCK;
+
+	if (lock_op(fd, F_OFD_SETLK, &fl) != 0) {
+		int err = errno;
+		close(fd);
+		errno = (err == EACCES) ? EAGAIN : err;
+		return -1;
+	}
+
+	instance_record rec = {};
+
+	rec.magic       = record_magic;
+	rec.index       = index;
+	rec.pid         = getpid();
+	rec.start_token = start_token(rec.pid);
+
+	std::string pid(std::to_string(rec.pid) + "\n");
+
+	if (pwrite(fd, &rec, sizeof(rec), 0) != static_cast<ssize_t>(sizeof(rec)) ||
+	    write_file_atomic(pid_path(dir, name, index), pid.data(), pid.size()) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+void instance::release(const std::string &dir, const std::string &name, unsigned index, int lock_fd) {
+	unlink(pid_path(dir, name, index).c_str());
+
+	/* lock file stays, removing it would let two claimers lock different inodes */
+	if (lock_fd >= 0) {
+		close(lock_fd);
+	}
+}
+
+instance_set::instance_set(const std::string &dir, const std::string &name, unsigned count)
+	: dir_(dir)
+	, name_(name)
+	, fds_(count, -1)
+	, tokens_(count, 0)
+{}
+
+instance_set::~instance_set() {
+	for (int fd : fds_) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
+
+pid_t instance_set::holder(unsigned index, instance_record *rec, bool verify) {
+	if (index >= fds_.size()) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bool reopened = false;
+
+	for (;;) {
+		int &fd = fds_[index];
+
+		if (fd < 0) {
+			fd = open(instance::lock_path(dir_, name_, index).c_str(), O_RDONLY | O_CLOEXEC);
+
+			if (fd < 0) {
+				return errno == ENOENT ? 0 : -1;
+			}
+
+			reopened = true;
+		}
+
+		struct flock fl = {};
+		fl.l_type = F_RDLCK;
+
+		if (lock_op(fd, F_OFD_GETLK, &fl) != 0) {
+			return -1;
+		}
+
+		if (fl.l_type != F_UNLCK) {
+			break;
+		}
+
+		if (reopened) {
+			return 0;
+		}
+
+		/* cached descriptor may refer to lock file replaced under us */
+		close(fd);
+		fd = -1;
+		tokens_[index] = 0;
+	}
+
+	/* OFD locks do not report holder, take it from the record */
+	if (pread(fds_[index], rec, sizeof(*rec), 0) != static_cast<ssize_t>(sizeof(*rec)) ||
+	    rec->magic != record_magic || rec->index != index || rec->pid <= 0 || rec->start_token == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/*
+	 * Record may be left by previous holder while new one has not written its own yet.
+	 * It is checked against /proc once per record, pid of a record known to be valid can not
+	 * be reused while the lock is held
+	 */
+	if (verify || rec->start_token != tokens_[index]) {
+		if (rec->start_token != instance::start_token(rec->pid)) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		tokens_[index] = rec->start_token;
+	}
+
+	return rec->pid;
+}
+
+pid_t instance_set::alive(unsigned index) {
+	instance_record rec;
+
+	return holder(index, &rec);
+}
+
+int instance_set::pidfd(unsigned index) {
+	instance_record rec;
+	pid_t pid = holder(index, &rec, true);
+
+	if (pid <= 0) {
+		if (pid == 0) {
+			errno = ESRCH;
+		}
+		return -1;
+	}
+
+#ifdef SYS_pidfd_open
+	int fd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* lock still held by the same process, so pidfd refers to the instance and not to a reused pid */
+	if (holder(index, &rec, true) != pid) {
+		close(fd);
+		errno = ESRCH;
+		return -1;
+	}
+
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int instance_set::record(unsigned index, instance_record *rec) {
+	pid_t pid = holder(index, rec);
+
+	if (pid <= 0) {
+		if (pid == 0) {
+			errno = ESRCH;
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+} // namespace daemonize
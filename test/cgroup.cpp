@@ -0,0 +1,209 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * cgroup v2 helpers test
+ *
+ * Usage: daemonize_cgroup
+ *
+ * Works with a relative group under the cgroup of the test, so it runs unprivileged inside
+ * of a delegated subtree. Creates the group, applies limits, spawns a child straight into it
+ * with spawn_opts::cgroup_fd and reads its stats.
+ * Exits with 77 (skipped) if there is no writable cgroup2 hierarchy.
+ */
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <daemon/daemonize.hpp>
+#include <daemon/cgroup.hpp>
+
+static const int exit_skip = 77;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                   \
+	do {                                                                              \
+		if (!(cond)) {                                                                \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			++failures;                                                               \
+		}                                                                             \
+	} while (0)
+
+using daemonize::cgroup;
+
+static bool ends_with(const std::string &s, const std::string &tail) {
+	return s.size() >= tail.size() && s.compare(s.size() - tail.size(), tail.size(), tail) == 0;
+}
+
+static void test_resolve(const std::string &mount) {
+	std::string abs;
+
+	CHECK(cgroup::resolve(mount, &abs) == 0 && abs == mount);
+	CHECK(cgroup::resolve(mount + "/a/b", &abs) == 0 && abs == mount + "/a/b");
+	CHECK(cgroup::resolve("/a/b", &abs) == 0 && abs == mount + "/a/b");
+
+	/* shares prefix with the mount, but is not under it */
+	CHECK(cgroup::resolve(mount + "X/a", &abs) == 0 && abs == mount + mount + "X/a");
+
+	std::string own;
+	CHECK(cgroup::resolve("a/b", &abs) == 0 && cgroup::resolve(".", &own) == 0);
+	CHECK(abs == own.substr(0, own.size() - 1) + "a/b");
+}
+
+/**
+ * \brief   Read one line of spawned child's output
+ */
+static std::string read_line(int fd) {
+	std::string line;
+	char c;
+
+	while (read(fd, &c, 1) == 1 && c != '\n') {
+		line.push_back(c);
+	}
+
+	return line;
+}
+
+static void test_spawn(const std::string &group) {
+	std::string abs;
+	CHECK(cgroup::resolve(group, &abs) == 0);
+
+	daemonize::cgroup_limits limits;
+
+	if (access((abs + "/pids.max").c_str(), W_OK) == 0) {
+		limits.pids_max = "64";
+	}
+
+	CHECK(cgroup::apply(group, limits) == 0);
+
+	int fd = cgroup::open(group);
+	CHECK(fd >= 0);
+
+	if (fd < 0) {
+		return;
+	}
+
+	/* reports own cgroup and lingers, so the group is not empty while stats are read */
+	const char *argv[] = {"/bin/sh", "-c", "grep '^0::' /proc/self/cgroup; exec sleep 10", nullptr};
+
+	daemonize::spawn_opts opts;
+	opts.out       = daemonize::stdio_mode::pipe;
+	opts.cgroup_fd = fd;
+
+	pid_t pid = daemonize::child::execute(argv[0], argv, nullptr, &opts);
+	close(fd);
+
+	CHECK(pid > 0);
+
+	if (pid <= 0) {
+		return;
+	}
+
+	std::string line(read_line(opts.out_fd));
+	std::string rel(abs.substr(abs.find(group) - 1));
+
+	CHECK(ends_with(line, rel));
+
+	daemonize::cgroup_stats st;
+	CHECK(cgroup::stats(group, &st) == 0);
+
+	if (!limits.pids_max.empty()) {
+		CHECK(st.pids_current >= 1);
+	}
+
+	kill(pid, SIGKILL);
+	close(opts.out_fd);
+
+	while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+	}
+}
+
+/**
+ * \brief   Remove group, it stays busy for a moment after the last process is reaped
+ */
+static int remove_group(const std::string &group) {
+	std::string abs;
+
+	if (cgroup::resolve(group, &abs) != 0) {
+		return -1;
+	}
+
+	int rc;
+
+	for (int attempt = 0; (rc = rmdir(abs.c_str())) != 0 && errno == EBUSY && attempt < 100; ++attempt) {
+		usleep(10000);
+	}
+
+	if (rc != 0) {
+		fprintf(stderr, "rmdir %s: %s\n", abs.c_str(), strerror(errno));
+	}
+
+	return rc;
+}
+
+int main() {
+	std::string mount;
+
+	if (cgroup::resolve("/", &mount) != 0) {
+		printf("cgroup: skipped, no cgroup2 mount\n");
+		return exit_skip;
+	}
+
+	mount.pop_back();
+
+	test_resolve(mount);
+
+	std::string parent("daemonize_test." + std::to_string(getpid()));
+	std::string group(parent + "/job");
+
+	if (cgroup::create(group) != 0) {
+		if (errno == EACCES || errno == EPERM || errno == EROFS || errno == ENOENT) {
+			printf("cgroup: skipped, cgroup2 is not writable: %s\n", strerror(errno));
+			return exit_skip;
+		}
+
+		fprintf(stderr, "create: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* existing group is not an error */
+	CHECK(cgroup::create(group) == 0);
+
+	test_spawn(group);
+
+	CHECK(remove_group(group) == 0);
+	CHECK(remove_group(parent) == 0);
+
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("cgroup: ok\n");
+
+	return EXIT_SUCCESS;
+}
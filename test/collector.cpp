@@ -0,0 +1,258 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Output collector test
+ *
+ * Usage: daemonize_collector
+ *
+ * Feeds pipes registered in collector and checks line framing, prefixes, caps of lines and
+ * raw mode, cut of oversized unterminated lines, flush at eof and jobs with several streams.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <daemon/collector.hpp>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                   \
+	do {                                                                              \
+		if (!(cond)) {                                                                \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			++failures;                                                               \
+		}                                                                             \
+	} while (0)
+
+using daemonize::collector;
+using daemonize::capture_opts;
+using daemonize::capture_output;
+
+/**
+ * \brief   Register read end of a new pipe
+ *
+ * \return write end, -1 on error
+ */
+static int open_stream(collector &c, collector::job_id job, const capture_opts &opts) {
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		return -1;
+	}
+
+	if (c.add(job, fds[0], opts) != 0) {
+		close(fds[1]);
+		return -1;
+	}
+
+	return fds[1];
+}
+
+static void feed(collector &c, int fd, const char *data) {
+	if (write(fd, data, strlen(data)) != static_cast<ssize_t>(strlen(data))) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+
+	/* small writes are read at once, so one readiness event per write */
+	while (c.poll(0) > 0) {
+	}
+}
+
+static void finish(collector &c, int fd) {
+	close(fd);
+
+	while (c.poll(0) > 0) {
+	}
+}
+
+static capture_output take(collector &c, collector::job_id job) {
+	capture_output out;
+
+	CHECK(c.take(job, &out));
+
+	return out;
+}
+
+static void test_framing() {
+	collector c;
+	capture_opts opts;
+	opts.prefix = "[p] ";
+
+	int fd = open_stream(c, 1, opts);
+	CHECK(fd >= 0);
+
+	feed(c, fd, "ab");
+	CHECK(take(c, 1).data.empty());
+
+	feed(c, fd, "c\nd");
+	capture_output out = take(c, 1);
+	CHECK(out.data == "[p] abc\n");
+	CHECK(!out.eof);
+
+	feed(c, fd, "e\nf\ng");
+	CHECK(take(c, 1).data == "[p] de\n[p] f\n");
+
+	/* unterminated line is flushed at eof */
+	finish(c, fd);
+	out = take(c, 1);
+	CHECK(out.data == "[p] g\n");
+	CHECK(out.eof);
+	CHECK(out.dropped == 0);
+
+	/* job is forgotten once eof is reported */
+	CHECK(!c.take(1, &out));
+	CHECK(c.jobs() == 0);
+}
+
+static void test_line_cap() {
+	collector c;
+	capture_opts opts;
+	opts.max_bytes = 16;
+
+	int fd = open_stream(c, 1, opts);
+
+	feed(c, fd, "0123456789\n");
+	feed(c, fd, "abcdef\n");
+	feed(c, fd, "xyz\n");
+
+	/* lines are kept or dropped whole */
+	capture_output out = take(c, 1);
+	CHECK(out.data == "0123456789\nxyz\n");
+	CHECK(out.dropped == 7);
+
+	/* cap applies to buffered data, taking output makes room again */
+	feed(c, fd, "abcdef\n");
+	out = take(c, 1);
+	CHECK(out.data == "abcdef\n");
+	CHECK(out.dropped == 0);
+
+	finish(c, fd);
+}
+
+static void test_oversized_line() {
+	collector c;
+	capture_opts opts;
+	opts.max_bytes = 16;
+	opts.prefix    = "[j] ";
+
+	int fd = open_stream(c, 1, opts);
+
+	/* cut to what fits with prefix and newline */
+	feed(c, fd, "AAAAAAAAAAAAAAAAAAAAAAAA");
+	capture_output out = take(c, 1);
+	CHECK(out.data == "[j] AAAAAAAAAAA\n");
+	CHECK(out.dropped == 13);
+
+	/* rest of the cut line is dropped, not made into a line of it's own */
+	feed(c, fd, "BBBB");
+	feed(c, fd, "BBBB\nCC\n");
+	out = take(c, 1);
+	CHECK(out.data == "[j] CC\n");
+	CHECK(out.dropped == 8);
+
+	finish(c, fd);
+	out = take(c, 1);
+	CHECK(out.data.empty());
+	CHECK(out.eof);
+}
+
+static void test_raw_cap() {
+	collector c;
+	capture_opts opts;
+	opts.max_bytes = 8;
+	opts.lines     = false;
+	opts.prefix    = "ignored";
+
+	int fd = open_stream(c, 1, opts);
+
+	feed(c, fd, "0123\n56789ab");
+	finish(c, fd);
+
+	capture_output out = take(c, 1);
+	CHECK(out.data == "0123\n567");
+	CHECK(out.dropped == 4);
+	CHECK(out.eof);
+}
+
+static void test_streams_of_job() {
+	collector c;
+	capture_opts out_opts;
+	capture_opts err_opts;
+	out_opts.prefix = "out: ";
+	err_opts.prefix = "err: ";
+
+	int out_fd = open_stream(c, 7, out_opts);
+	int err_fd = open_stream(c, 7, err_opts);
+	int other  = open_stream(c, 8, capture_opts());
+
+	feed(c, out_fd, "one\n");
+	feed(c, err_fd, "two\n");
+	feed(c, other, "three\n");
+	feed(c, out_fd, "four");
+
+	capture_output out = take(c, 7);
+	CHECK(out.data == "out: one\nerr: two\n");
+	CHECK(take(c, 8).data == "three\n");
+
+	/* job reaches eof with the last of it's streams */
+	finish(c, out_fd);
+	out = take(c, 7);
+	CHECK(out.data == "out: four\n");
+	CHECK(!out.eof);
+
+	finish(c, err_fd);
+	out = take(c, 7);
+	CHECK(out.eof);
+
+	c.remove(8);
+	CHECK(c.jobs() == 0);
+
+	/* removed job's stream is closed by collector */
+	CHECK(write(other, "x", 1) < 0 && errno == EPIPE);
+	close(other);
+}
+
+int main() {
+	/* write to the stream of removed job must fail instead of killing the test */
+	signal(SIGPIPE, SIG_IGN);
+
+	test_framing();
+	test_line_cap();
+	test_oversized_line();
+	test_raw_cap();
+	test_streams_of_job();
+
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("collector: ok\n");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Instance lock regression test
+ *
+ * Usage: daemonize_instance
+ *
+ * Claims an instance, probes it from the same process with instance_set (cached and
+ * destroyed probes), then checks from a forked child that the slot is still locked.
+ * Fails if probing reports the instance wrong or drops the lock of the claimer.
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <daemon/instance.hpp>
+
+static const char     *name  = "svc";
+static const unsigned  index = 3;
+static const unsigned  count = 5;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+	do {                                                              \
+		if (!(cond)) {                                                \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			++failures;                                               \
+		}                                                             \
+	} while (0)
+
+/**
+ * \return errno of claim made by a forked child, 0 if child got the slot
+ */
+static int claim_from_child(const std::string &dir) {
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		return -1;
+	}
+
+	if (pid == 0) {
+		int fd = daemonize::instance::claim(dir, name, index);
+		_exit(fd >= 0 ? 0 : errno);
+	}
+
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+	}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main() {
+	char tmpl[] = "/tmp/daemonize_instance.XXXXXX";
+
+	if (mkdtemp(tmpl) == nullptr) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	std::string dir(tmpl);
+
+	int lock_fd = daemonize::instance::claim(dir, name, index);
+	if (lock_fd < 0) {
+		perror("claim");
+		return EXIT_FAILURE;
+	}
+
+	CHECK(daemonize::instance::claim(dir, name, index) < 0 && errno == EAGAIN);
+
+	{
+		daemonize::instance_set set(dir, name, count);
+		daemonize::instance_record rec = {};
+
+		CHECK(set.alive(index) == getpid());
+		/* second probe goes through cached descriptor */
+		CHECK(set.alive(index) == getpid());
+		CHECK(set.record(index, &rec) == 0 && rec.pid == getpid() && rec.index == index);
+		CHECK(set.alive(index + 1) == 0);
+		CHECK(set.alive(count) < 0 && errno == EINVAL);
+
+		int pidfd = set.pidfd(index);
+		CHECK(pidfd >= 0 || errno == ENOSYS);
+		if (pidfd >= 0) {
+			close(pidfd);
+		}
+	}
+
+	/* probe descriptors are closed now, the claim must survive it */
+	CHECK(claim_from_child(dir) == EAGAIN);
+
+	daemonize::instance::release(dir, name, index, lock_fd);
+
+	{
+		daemonize::instance_set set(dir, name, count);
+
+		CHECK(set.alive(index) == 0);
+	}
+
+	CHECK(claim_from_child(dir) == 0);
+
+	unlink(daemonize::instance::lock_path(dir, name, index).c_str());
+	unlink(daemonize::instance::pid_path(dir, name, index).c_str());
+	rmdir(dir.c_str());
+
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("instance: ok\n");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,322 @@
+/**
+ * Copyright [2016]
+ *
+ * \author [Artur Troian <troian dot ap at gmail dot com>]
+ * \author [Oleg Kravchenko <troian dot ap at gmail dot com>]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Concurrent spawn stress test
+ *
+ * Usage: daemonize_stress [spawns] [threads] [program]
+ *
+ * Every thread spawns its share of children with child::execute() (half of them with captured stdout),
+ * while opening and closing descriptors without O_CLOEXEC to race with forks of other threads.
+ * Every 8th child and the first detached::execute() daemon of each thread is the test itself
+ * run with --report-fds, which lists it's descriptors above stderr.
+ * Fails if a spawn fails, a descriptor leaks into a child or the test, a zombie is left behind
+ * or no progress is made for a while (deadlock).
+ */
+
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <daemon/daemonize.hpp>
+
+static const int stall_timeout_sec  = 30;
+static const int report_timeout_sec = 10;
+static const unsigned long report_every = 8;
+
+static std::atomic<unsigned long> g_done(0);
+static std::atomic<unsigned long> g_failed(0);
+static std::atomic<unsigned long> g_leaked(0);
+
+static std::string g_self;       ///< path of the test executable
+static std::string g_report_dir; ///< reports of detached children
+
+static int count_fds() {
+	int count = 0;
+
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir == nullptr) {
+		return -1;
+	}
+
+	while (dirent *ent = readdir(dir)) {
+		if (ent->d_name[0] != '.') {
+			++count;
+		}
+	}
+
+	closedir(dir);
+
+	return count;
+}
+
+/**
+ * \brief   Child side of the leak check: list descriptors above stderr
+ *
+ * \param[in]  out_path - file to write the list to, stdout if null
+ */
+static int report_fds(const char *out_path) {
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir == nullptr) {
+		return EXIT_FAILURE;
+	}
+
+	std::string list;
+
+	while (dirent *ent = readdir(dir)) {
+		int fd = atoi(ent->d_name);
+
+		if (ent->d_name[0] != '.' && fd > STDERR_FILENO && fd != dirfd(dir)) {
+			list += ent->d_name;
+			list += ' ';
+		}
+	}
+
+	closedir(dir);
+
+	if (out_path == nullptr) {
+		fputs(list.c_str(), stdout);
+		return EXIT_SUCCESS;
+	}
+
+	/* complete report appears at once */
+	std::string tmp(std::string(out_path) + ".tmp");
+
+	FILE *f = fopen(tmp.c_str(), "we");
+	if (f == nullptr) {
+		return EXIT_FAILURE;
+	}
+
+	fputs(list.c_str(), f);
+
+	if (fclose(f) != 0 || rename(tmp.c_str(), out_path) != 0) {
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static void check_report(const char *who, const std::string &list) {
+	if (!list.empty()) {
+		fprintf(stderr, "descriptors leaked into %s: %s\n", who, list.c_str());
+		++g_leaked;
+	}
+}
+
+static void spawn_detached(unsigned long id) {
+	std::string out(g_report_dir + "/" + std::to_string(id));
+	const char *argv[] = {g_self.c_str(), "--report-fds", out.c_str(), nullptr};
+
+	int racer = open("/dev/null", O_RDONLY);
+
+	if (daemonize::detached::execute(g_self.c_str(), argv) < 0) {
+		fprintf(stderr, "detached spawn failed: %s\n", strerror(errno));
+		++g_failed;
+	}
+
+	if (racer >= 0) {
+		close(racer);
+	}
+}
+
+static void worker(unsigned long id, unsigned long spawns, const char *program) {
+	const char *argv[]  = {program, nullptr};
+	const char *probe[] = {g_self.c_str(), "--report-fds", nullptr};
+
+	if (spawns > 0) {
+		spawn_detached(id);
+	}
+
+	for (unsigned long i = 0; i < spawns; ++i) {
+		/* deliberately not O_CLOEXEC, must not survive in children of other threads */
+		int racer = open("/dev/null", O_RDONLY);
+
+		bool report = i % report_every == 0;
+
+		daemonize::spawn_opts opts;
+		opts.out = (report || (i & 1)) ? daemonize::stdio_mode::pipe : daemonize::stdio_mode::null;
+
+		pid_t pid = report ? daemonize::child::execute(probe[0], probe, nullptr, &opts)
+		                   : daemonize::child::execute(program, argv, nullptr, &opts);
+
+		if (racer >= 0) {
+			close(racer);
+		}
+
+		if (pid < 0) {
+			fprintf(stderr, "spawn failed: %s\n", strerror(errno));
+			++g_failed;
+			continue;
+		}
+
+		if (opts.out_fd >= 0) {
+			std::string output;
+			char buf[256];
+			ssize_t rd;
+
+			while ((rd = read(opts.out_fd, buf, sizeof(buf))) > 0) {
+				output.append(buf, static_cast<size_t>(rd));
+			}
+			close(opts.out_fd);
+
+			if (report) {
+				check_report("child", output);
+			}
+		}
+
+		int status;
+
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			++g_failed;
+		}
+
+		++g_done;
+	}
+}
+
+/**
+ * \brief   Wait for reports of detached children, they are not ours to wait for
+ */
+static void check_detached(unsigned long count) {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(report_timeout_sec);
+
+	for (unsigned long id = 0; id < count; ++id) {
+		std::string path(g_report_dir + "/" + std::to_string(id));
+		FILE *f;
+
+		while ((f = fopen(path.c_str(), "re")) == nullptr && std::chrono::steady_clock::now() < deadline) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		if (f == nullptr) {
+			fprintf(stderr, "no report from detached child %lu\n", id);
+			++g_failed;
+			continue;
+		}
+
+		char buf[256] = {};
+		size_t rd = fread(buf, 1, sizeof(buf) - 1, f);
+
+		fclose(f);
+		unlink(path.c_str());
+
+		check_report("detached child", std::string(buf, rd));
+	}
+
+	rmdir(g_report_dir.c_str());
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1 && strcmp(argv[1], "--report-fds") == 0) {
+		return report_fds(argc > 2 ? argv[2] : nullptr);
+	}
+
+	unsigned long spawns  = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+	unsigned long threads = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+	const char *program   = argc > 3 ? argv[3] : "/bin/true";
+
+	if (threads == 0) {
+		threads = 1;
+	}
+
+	char self[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+
+	char report_dir[] = "/tmp/daemonize_stress.XXXXXX";
+
+	if (len <= 0 || mkdtemp(report_dir) == nullptr) {
+		perror("setup");
+		return EXIT_FAILURE;
+	}
+
+	g_self.assign(self, static_cast<size_t>(len));
+	g_report_dir = report_dir;
+
+	int fds_before = count_fds();
+
+	std::atomic<bool> running(true);
+
+	/* watchdog: spawning threads make no progress - report deadlock */
+	std::thread watchdog([&running]() {
+		unsigned long last = 0;
+		int stalled = 0;
+
+		while (running) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+
+			unsigned long done = g_done.load();
+
+			stalled = (done == last) ? stalled + 1 : 0;
+			last = done;
+
+			if (stalled >= stall_timeout_sec) {
+				fprintf(stderr, "no progress for %d seconds after %lu spawns, deadlock?\n", stall_timeout_sec, done);
+				_exit(EXIT_FAILURE);
+			}
+		}
+	});
+
+	auto started = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+
+	for (unsigned long t = 0; t < threads; ++t) {
+		workers.emplace_back(worker, t, spawns / threads + (t < spawns % threads ? 1 : 0), program);
+	}
+
+	for (auto &w : workers) {
+		w.join();
+	}
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	running = false;
+	watchdog.join();
+
+	check_detached(std::min(threads, spawns));
+
+	int fds_after = count_fds();
+	bool zombies  = waitpid(-1, nullptr, WNOHANG) != -1 || errno != ECHILD;
+
+	printf("spawns: %lu, threads: %lu, failed: %lu, time: %.2fs, throughput: %.0f spawns/s\n",
+	       g_done.load(), threads, g_failed.load(), elapsed, elapsed > 0 ? g_done.load() / elapsed : 0.0);
+	printf("fds before: %d, after: %d, leaked into children: %lu, zombies: %s\n",
+	       fds_before, fds_after, g_leaked.load(), zombies ? "yes" : "no");
+
+	if (g_failed != 0 || g_leaked != 0 || fds_after != fds_before || zombies) {
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
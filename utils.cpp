@@ -3,16 +3,125 @@
 //
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
+#include <cerrno>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 
 #include <daemon/utils.hpp>
 
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
 namespace daemonize {
 
-int close_derived_fds() {
+/* struct clone_args of linux/sched.h up to CLONE_ARGS_SIZE_VER2 */
+struct clone3_args {
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t tls;
+	uint64_t set_tid;
+	uint64_t set_tid_size;
+	uint64_t cgroup;
+};
+
+/* struct linux_dirent64 as returned by getdents64() */
+struct dirent64_hdr {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[1];
+};
+
+static int close_fd_range(unsigned int first, unsigned int last) {
+	if (first > last) {
+		return 0;
+	}
+
+#ifdef SYS_close_range
+	return syscall(SYS_close_range, first, last, 0) == 0 ? 0 : -1;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * \brief   Walk /proc/self/fd with raw getdents64(), so it's safe between fork and exec
+ *
+ * \return 0 on success, -1 if /proc is not available
+ */
+static int close_listed_fds(int keep_fd) {
+#ifdef SYS_getdents64
+	int dir_fd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (dir_fd < 0) {
+		return -1;
+	}
+
+	alignas(8) char buf[1024];
+	long len;
+
+	while ((len = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf))) > 0) {
+		for (long off = 0; off < len;) {
+			const dirent64_hdr *ent = reinterpret_cast<const dirent64_hdr *>(buf + off);
+			off += ent->d_reclen;
+
+			int fd = 0;
+			const char *c = ent->d_name;
+
+			if (*c < '0' || *c > '9') {
+				continue;
+			}
+
+			for (; *c >= '0' && *c <= '9'; ++c) {
+				fd = fd * 10 + (*c - '0');
+			}
+
+			if (fd > STDERR_FILENO && fd != keep_fd && fd != dir_fd) {
+				close(fd);
+			}
+		}
+	}
+
+	close(dir_fd);
+
+	return len < 0 ? -1 : 0;
+#else
+	(void)keep_fd;
+
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int close_derived_fds(int keep_fd) {
+	/* one syscall regardless of descriptor table size */
+	if (keep_fd > STDERR_FILENO) {
+		if (close_fd_range(3, static_cast<unsigned int>(keep_fd) - 1) == 0 &&
+		    close_fd_range(static_cast<unsigned int>(keep_fd) + 1, ~0U) == 0) {
+			return 0;
+		}
+	} else if (close_fd_range(3, ~0U) == 0) {
+		return 0;
+	}
+
+	if (close_listed_fds(keep_fd) == 0) {
+		return 0;
+	}
+
 	/* retrieve maximum fd number */
 	int max_fds = getdtablesize();
 
@@ -24,7 +133,7 @@ int close_derived_fds() {
 	for (int fd = 3; fd < max_fds; ++fd) {
 		struct stat st = {};
 
-		if (fstat(fd, &st) == 0) {
+		if (fd != keep_fd && fstat(fd, &st) == 0) {
 			/* fd used */
 			if (close(fd) != 0) {
 				return -1;
@@ -35,4 +144,105 @@ int close_derived_fds() {
 	return 0;
 }
 
+pid_t fork_into_cgroup(int cgroup_fd) {
+#ifdef SYS_clone3
+	clone3_args args = {};
+
+	args.flags       = CLONE_INTO_CGROUP;
+	args.exit_signal = SIGCHLD;
+	args.cgroup      = static_cast<uint64_t>(cgroup_fd);
+
+	long ret = syscall(SYS_clone3, &args, sizeof(args));
+
+	if (ret >= 0) {
+		return static_cast<pid_t>(ret);
+	}
+
+	/* anything else than missing clone3 or CLONE_INTO_CGROUP support is real error */
+	if (errno != ENOSYS && errno != E2BIG && errno != EINVAL) {
+		return -1;
+	}
+#endif
+
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		int fd = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+
+		if (fd < 0 || write(fd, "0", 1) != 1) {
+			_exit(EXIT_FAILURE);
+		}
+
+		close(fd);
+	}
+
+	return pid;
+}
+
+int write_file_atomic(const std::string &path, const void *data, size_t size, mode_t mode) {
+	std::string tmp(path + ".XXXXXX");
+
+	int fd = mkostemp(&tmp[0], O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	const char *p = static_cast<const char *>(data);
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t wr = write(fd, p + done, size - done);
+
+		if (wr < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto fail;
+		}
+
+		done += static_cast<size_t>(wr);
+	}
+
+	if (fchmod(fd, mode) != 0 || fsync(fd) != 0) {
+		goto fail;
+	}
+
+	if (close(fd) != 0) {
+		fd = -1;
+		goto fail;
+	}
+
+	fd = -1;
+
+	if (rename(tmp.c_str(), path.c_str()) != 0) {
+		goto fail;
+	}
+
+	{
+		/* make rename itself durable */
+		size_t slash = path.rfind('/');
+		std::string dir(slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash)));
+
+		int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir_fd >= 0) {
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+	}
+
+	return 0;
+
+fail:
+	int err = errno;
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	unlink(tmp.c_str());
+	errno = err;
+
+	return -1;
+}
+
 } // namespace daemonize